@@ -0,0 +1,262 @@
+#include "bpm.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SAMPLES 100000
+#define BATCH 64                // Per-frame calls timed together, they are shorter than a clock read
+#define THREAD_FRAMES 2000000
+#define MAX_THREADS 32
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const uint64_t* sorted, int n, double p) {
+    return (double)sorted[(int)(p * (n - 1))];
+}
+
+static void report(const char* name, uint64_t* samples, int n, int per_sample) {
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    printf("%-34s %10.1f %10.1f %10.1f\n", name,
+           percentile(samples, n, 0.50) / per_sample,
+           percentile(samples, n, 0.99) / per_sample,
+           percentile(samples, n, 0.999) / per_sample);
+}
+
+static uint64_t samples[SAMPLES];
+
+/* Single-threaded latency, ns per call */
+
+static void bench_frame_event(const char* name, void (*event)(uint32_t)) {
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        for (int j=0; j<BATCH; j++) {
+            event(0);
+        }
+        samples[i] = now_ns() - start;
+    }
+    report(name, samples, SAMPLES, BATCH);
+}
+
+static void bench_track_handle(void) {
+    bpm_track_t* track = bpm_track(0);
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        for (int j=0; j<BATCH; j++) {
+            bpm_track_frame_encoded(track);
+        }
+        samples[i] = now_ns() - start;
+    }
+    report("bpm_track_frame_encoded", samples, SAMPLES, BATCH);
+}
+
+static void bench_frames_report(void) {
+    bpm_event_t events[BATCH];
+    for (int j=0; j<BATCH; j++) {
+        events[j] = (bpm_event_t){ .track_idx = j % 4, .kind = BPM_EVENT_ENCODED, .count = 1 };
+    }
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        bpm_frames_report(events, BATCH);
+        samples[i] = now_ns() - start;
+    }
+    report("bpm_frames_report (per event)", samples, SAMPLES, BATCH);
+}
+
+static void bench_render_ptr(void) {
+    uint8_t* data = NULL;
+    uint32_t size = 0;
+
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        bpm_render_ts_ptr(0, 0, 0, 0, &data, &size);
+        bpm_destroy(data);
+        samples[i] = now_ns() - start;
+    }
+    report("bpm_render_ts_ptr + bpm_destroy", samples, SAMPLES, 1);
+
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        bpm_render_sm_ptr(0, &data, &size);
+        bpm_destroy(data);
+        samples[i] = now_ns() - start;
+    }
+    report("bpm_render_sm_ptr + bpm_destroy", samples, SAMPLES, 1);
+
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        bpm_render_erm_ptr(0, &data, &size);
+        bpm_destroy(data);
+        samples[i] = now_ns() - start;
+    }
+    report("bpm_render_erm_ptr + bpm_destroy", samples, SAMPLES, 1);
+}
+
+static void bench_render_into(void) {
+    uint8_t data[BPM_KEYFRAME_SIZE];
+    uint8_t sei[BPM_SEI_MAX_SIZE];
+    uint32_t size = 0;
+    bpm_keyframe_t layout;
+    int failed = 0;
+
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        failed += bpm_render_keyframe(0, 0, 0, 0, 0, data, sizeof(data), &size, &layout) != 0;
+        samples[i] = now_ns() - start;
+    }
+    report("bpm_render_keyframe", samples, SAMPLES, 1);
+
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        failed += bpm_render_sei_nal(BPM_CODEC_HEVC, BPM_FRAMING_ANNEXB, 0, 0, 0, 0, 0, sei, sizeof(sei), &size) != 0;
+        samples[i] = now_ns() - start;
+    }
+    report("bpm_render_sei_nal (HEVC)", samples, SAMPLES, 1);
+
+    // A failed render returns early, its time is not that of a render
+    if (failed > 0) {
+        fprintf(stderr, "%d renders failed\n", failed);
+        exit(1);
+    }
+}
+
+static void bench_rfc3339(void) {
+    uint8_t data[BPM_TS_SIZE];
+    uint32_t size = 0;
+    int64_t ms = 1700000000000;
+
+    // Four RFC 3339 fields per call, all in the same second as the cached one
+    for (int i=0; i<SAMPLES; i++) {
+        uint64_t start = now_ns();
+        bpm_render_ts_into64(ms + 1, ms + 2, ms + 3, ms + 4, data, sizeof(data), &size);
+        samples[i] = now_ns() - start;
+    }
+    report("RFC 3339 x4, cached second", samples, SAMPLES, 4);
+
+    // Every field in a new second
+    for (int i=0; i<SAMPLES; i++) {
+        int64_t t = ms + (int64_t)i * 4000;
+        uint64_t start = now_ns();
+        bpm_render_ts_into64(t, t + 1000, t + 2000, t + 3000, data, sizeof(data), &size);
+        samples[i] = now_ns() - start;
+    }
+    report("RFC 3339 x4, new second", samples, SAMPLES, 4);
+
+    // Every field on a new day
+    for (int i=0; i<SAMPLES; i++) {
+        int64_t t = ms + (int64_t)i * 4 * 86400000;
+        uint64_t start = now_ns();
+        bpm_render_ts_into64(t, t + 86400000, t + 2 * 86400000, t + 3 * 86400000, data, sizeof(data), &size);
+        samples[i] = now_ns() - start;
+    }
+    report("RFC 3339 x4, new day", samples, SAMPLES, 4);
+
+    // Binary durations instead of strings
+    bpm_set_timestamp_type(BPM_TS_TYPE_DURATION);
+    for (int i=0; i<SAMPLES; i++) {
+        int64_t t = ms + (int64_t)i * 4000;
+        uint64_t start = now_ns();
+        bpm_render_ts_into64(t, t + 1000, t + 2000, t + 3000, data, sizeof(data), &size);
+        samples[i] = now_ns() - start;
+    }
+    report("Duration x4", samples, SAMPLES, 4);
+    bpm_set_timestamp_type(BPM_TS_TYPE_RFC3339);
+}
+
+/* Contended throughput, every thread counting frames of one track */
+
+typedef struct {
+    pthread_t thread;
+    int track_idx;
+    pthread_barrier_t* start;
+} worker_t;
+
+static void* count_frames(void* arg) {
+    worker_t* worker = arg;
+    pthread_barrier_wait(worker->start);
+    for (int i=0; i<THREAD_FRAMES; i++) {
+        bpm_frame_encoded(worker->track_idx);
+        if ((i & 63) == 0) {
+            bpm_frame_lagged(worker->track_idx);
+        }
+    }
+    return NULL;
+}
+
+static void bench_threads(const char* name, int shared_track) {
+    worker_t workers[MAX_THREADS];
+    printf("\n%s, Mframes/s\n", name);
+    for (int threads=1; threads<=MAX_THREADS; threads*=2) {
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, threads + 1);
+        for (int i=0; i<threads; i++) {
+            workers[i].track_idx = shared_track ? 0 : i;
+            workers[i].start = &start;
+            pthread_create(&workers[i].thread, NULL, count_frames, &workers[i]);
+        }
+        pthread_barrier_wait(&start);
+        uint64_t begin = now_ns();
+        for (int i=0; i<threads; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        uint64_t elapsed = now_ns() - begin;
+        pthread_barrier_destroy(&start);
+        printf("%2d threads %10.1f\n", threads, (double)threads * THREAD_FRAMES * 1e3 / elapsed);
+    }
+}
+
+/* Replay of a recorded log, ns per recorded call */
+static int bench_replay(const char* path) {
+    bpm_session_t* session = bpm_session_create();
+    uint64_t start = now_ns();
+    int64_t calls = bpm_session_replay(session, path, NULL, NULL);
+    uint64_t elapsed = now_ns() - start;
+    bpm_session_destroy(session);
+    if (calls < 0) {
+        fprintf(stderr, "Cannot replay %s\n", path);
+        return 1;
+    }
+    printf("Replayed %lld calls, %.1f ns per call\n", (long long)calls, calls > 0 ? (double)elapsed / calls : 0.0);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        return bench_replay(argv[2]);
+    }
+    int threads_only = argc > 1 && strcmp(argv[1], "--threads") == 0;
+
+    for (int i=0; i<MAX_THREADS; i++) {
+        char fingerprint[16];
+        snprintf(fingerprint, sizeof(fingerprint), "track%d", i);
+        bpm_get_track_index(fingerprint);
+    }
+
+    if (!threads_only) {
+        printf("%-34s %10s %10s %10s\n", "ns per call", "p50", "p99", "p999");
+        bench_frame_event("bpm_frame_encoded", bpm_frame_encoded);
+        bench_frame_event("bpm_frame_lagged", bpm_frame_lagged);
+        bench_frame_event("bpm_frame_dropped", bpm_frame_dropped);
+        bench_track_handle();
+        bench_frames_report();
+        bench_render_ptr();
+        bench_render_into();
+        bench_rfc3339();
+    }
+
+    bench_threads("Own track per thread", 0);
+    bench_threads("Shared track", 1);
+    bpm_set_local_counters(1);
+    bench_threads("Shared track, thread-local counters", 1);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef BPM_H
@@ -7,16 +8,296 @@
 extern "C" {
 #endif
 
+#define BPM_TS_SIZE 125
+#define BPM_SM_SIZE 65
+#define BPM_ERM_SIZE 60
+
+#define BPM_CLOCK_UTC_MS 0
+#define BPM_CLOCK_MONOTONIC_NS 1
+
+/* Timestamp types of bpm_set_timestamp_type. The BPM_*_SIZE sizes are those of RFC 3339,
+   payloads with 8-byte durations are shorter: TS 57, SM 48 and ERM 43 bytes. */
+#define BPM_TS_TYPE_RFC3339 1
+#define BPM_TS_TYPE_DURATION 2
+
+#define BPM_KEYFRAME_SIZE (BPM_TS_SIZE + BPM_SM_SIZE + BPM_ERM_SIZE)
+#define BPM_SEI_MAX_SIZE 512
+
+#define BPM_CODEC_AVC 0
+#define BPM_CODEC_HEVC 1
+#define BPM_CODEC_AV1 2
+
+#define BPM_FRAMING_ANNEXB 0
+#define BPM_FRAMING_LENGTH 1
+
+typedef struct {
+    uint32_t ts_offset;
+    uint32_t ts_size;
+    uint32_t sm_offset;
+    uint32_t sm_size;
+    uint32_t erm_offset;
+    uint32_t erm_size;
+} bpm_keyframe_t;
+
+#define BPM_EVENT_ENCODED 0
+#define BPM_EVENT_LAGGED 1
+#define BPM_EVENT_DROPPED 2
+#define BPM_EVENT_BYTES_DROPPED 3   /* count in bytes */
+
+typedef struct {
+    uint32_t track_idx;
+    uint32_t kind;
+    uint32_t count;
+} bpm_event_t;
+
+typedef struct bpm_session bpm_session_t;
+typedef struct bpm_track bpm_track_t;
+
+/* Calls in the log of bpm_record_start, payloads rendered by bpm_replay */
+#define BPM_RECORD_FRAMES 1
+#define BPM_RECORD_MARK 2
+#define BPM_RECORD_TS 3
+#define BPM_RECORD_SM 4
+#define BPM_RECORD_ERM 5
+#define BPM_RECORD_TRACK 6
+#define BPM_RECORD_EPOCH 7
+#define BPM_RECORD_NO_TRACK 0xffffffff  /* track_idx of the TS renders that take no track */
+
+typedef void (*bpm_replay_fn)(void* user, uint32_t op, uint32_t track_idx, const uint8_t* data, uint32_t size);
+
+/* Windows of bpm_track_rates */
+#define BPM_RATE_WINDOW_1S 0
+#define BPM_RATE_WINDOW_5S 1
+#define BPM_RATE_WINDOW_30S 2
+
+typedef struct {
+    /* Frames counted in the window */
+    uint64_t encoded;
+    uint64_t lagged;
+    uint64_t dropped;
+
+    double fps;             /* Frames encoded per second */
+    double lagged_ratio;    /* Lagged share of the frames input to the rendition */
+    double dropped_ratio;   /* Dropped share of the frames input to the rendition */
+    uint32_t window_ms;     /* Time covered, shorter than the window while the track is new */
+} bpm_rates_t;
+
+#define BPM_SNAPSHOT_MAX_TRACKS 32
+
+typedef struct {
+    /* Frames counted since start */
+    uint64_t frames_encoded;
+    uint64_t frames_lagged;
+    uint64_t frames_dropped;
+    uint64_t bytes_dropped;
+
+    /* Encode latency (FER to FERC marks) of the frames between the last two ERM renders */
+    uint64_t encode_frames;
+    uint64_t encode_p50_us;
+    uint64_t encode_p95_us;
+    uint64_t encode_p99_us;
+
+    /* Values sent in the last metrics of the track, consistent with one render */
+    uint64_t sent_sm_rendered;
+    uint64_t sent_sm_lagged;
+    uint64_t sent_sm_dropped;
+    uint64_t sent_sm_output;
+    uint64_t sent_erm_input;
+    uint64_t sent_erm_skipped;
+    uint64_t sent_erm_output;
+} bpm_track_snapshot_t;
+
+typedef struct {
+    int64_t utc_ms;         /* Time of the snapshot */
+    uint32_t track_count;   /* Tracks in use, the first BPM_SNAPSHOT_MAX_TRACKS are copied */
+
+    /* Session metrics counted since start */
+    uint64_t sm_rendered;
+    uint64_t sm_lagged;
+    uint64_t sm_dropped;
+    uint64_t sm_output;
+
+    bpm_track_snapshot_t tracks[BPM_SNAPSHOT_MAX_TRACKS];
+} bpm_snapshot_t;
+
+/* Header of the shared-memory segment of bpm_shm_start, followed by a bpm_snapshot_t.
+ * Readers without bpm_shm_read check magic and version, then copy the snapshot and
+ * retry while seq is odd or changed during the copy. */
+#define BPM_SHM_MAGIC 0x314d5042   /* "BPM1" in little endian */
+#define BPM_SHM_VERSION 3
+
+typedef struct {
+    uint32_t magic;         /* BPM_SHM_MAGIC once the segment is initialized */
+    uint32_t version;       /* BPM_SHM_VERSION, layout of the segment */
+    uint32_t size;          /* Bytes in the segment */
+    uint32_t seq;           /* Odd while the snapshot is written */
+    uint32_t pid;           /* Process publishing the segment */
+    uint32_t interval_ms;   /* Period of the updates */
+} bpm_shm_header_t;
+
+/* Statistics of bpm_get_stats, library built with --features stats */
+#define BPM_STAT_FRAME_ENCODED 0
+#define BPM_STAT_FRAME_LAGGED 1
+#define BPM_STAT_FRAME_DROPPED 2
+#define BPM_STAT_FRAMES_REPORT 3
+#define BPM_STAT_MARK 4
+#define BPM_STAT_GET_TRACK_INDEX 5
+#define BPM_STAT_RENDER_TS 6
+#define BPM_STAT_RENDER_SM 7
+#define BPM_STAT_RENDER_ERM 8
+#define BPM_STAT_RENDER_KEYFRAME 9
+#define BPM_STAT_RENDER_SEI 10
+#define BPM_STAT_CALLS 11
+#define BPM_STAT_RENDERS (BPM_STAT_CALLS - BPM_STAT_RENDER_TS)
+#define BPM_STATS_BUCKETS 32   /* Bucket i counts durations of [2^(i-1), 2^i) ns, the last one all longer */
+
+typedef struct {
+    uint64_t calls[BPM_STAT_CALLS];                           /* By BPM_STAT_* */
+    uint64_t render_ns[BPM_STAT_RENDERS][BPM_STATS_BUCKETS];  /* By BPM_STAT_RENDER_* - BPM_STAT_RENDER_TS */
+    uint64_t render_ns_sum[BPM_STAT_RENDERS];
+    uint64_t lock_wait_ns[BPM_STATS_BUCKETS];
+    uint64_t lock_wait_ns_sum;
+    uint64_t lock_hold_ns[BPM_STATS_BUCKETS];
+    uint64_t lock_hold_ns_sum;
+} bpm_stats_t;
+
+/* FNV-1a 64-bit hash of a track fingerprint for bpm_get_track_index_hashed,
+   folded to a constant by the compiler for string literals */
+static inline uint64_t bpm_fingerprint_hash(const char* track_fingerprint) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*track_fingerprint) {
+        hash ^= (uint8_t)*track_fingerprint++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
 int bpm_get_track_index(const char* track_fingerprint);
-void bpm_frame_encoded(int track_idx);
-void bpm_frame_lagged(int track_idx);
-void bpm_frame_dropped(int track_idx);
-uint8_t bpm_render_ts_ptr(int ts_cts, int ts_fer, int ts_ferc, int ts_pir, uint8_t** ts_data, uint32_t* ts_size);
-uint8_t bpm_render_sm_ptr(int track_idx, uint8_t** ts_data, uint32_t* ts_size);
-uint8_t bpm_render_erm_ptr(int track_idx, uint8_t** ts_data, uint32_t* ts_size);
+int bpm_get_track_index_hashed(const char* track_fingerprint, uint64_t track_fingerprint_hash);
+void bpm_frame_encoded(uint32_t track_idx);
+void bpm_frame_lagged(uint32_t track_idx);
+void bpm_frame_dropped(uint32_t track_idx);
+int bpm_frames_report(const bpm_event_t* events, size_t n);
+bpm_track_t* bpm_track(uint32_t track_idx);
+void bpm_track_frame_encoded(bpm_track_t* track);
+void bpm_track_frame_lagged(bpm_track_t* track);
+void bpm_track_frame_dropped(bpm_track_t* track);
+void bpm_bytes_dropped(uint32_t track_idx, uint32_t bytes);
+void bpm_track_bytes_dropped(bpm_track_t* track, uint32_t bytes);
+int bpm_track_rates(uint32_t track_idx, uint32_t window, bpm_rates_t* out);
+void bpm_mark_cts(uint32_t track_idx, uint64_t frame_id, int64_t ts);
+void bpm_mark_fer(uint32_t track_idx, uint64_t frame_id, int64_t ts);
+void bpm_mark_ferc(uint32_t track_idx, uint64_t frame_id, int64_t ts);
+void bpm_mark_pir(uint32_t track_idx, uint64_t frame_id, int64_t ts);
+int bpm_render_ts_ptr(uint32_t ts_cts, uint32_t ts_fer, uint32_t ts_ferc, uint32_t ts_pir, uint8_t** ts_data, uint32_t* ts_size);
+int bpm_render_ts_ptr64(int64_t ts_cts, int64_t ts_fer, int64_t ts_ferc, int64_t ts_pir, uint8_t** ts_data, uint32_t* ts_size);
+int bpm_render_sm_ptr(uint32_t track_idx, uint8_t** sm_data, uint32_t* sm_size);
+int bpm_render_erm_ptr(uint32_t track_idx, uint8_t** erm_data, uint32_t* erm_size);
+int bpm_render_ts_into(uint32_t ts_cts, uint32_t ts_fer, uint32_t ts_ferc, uint32_t ts_pir, uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_render_ts_into64(int64_t ts_cts, int64_t ts_fer, int64_t ts_ferc, int64_t ts_pir, uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_render_ts_frame_into(uint32_t track_idx, uint64_t frame_id, uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_render_sm_into(uint32_t track_idx, uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_render_erm_into(uint32_t track_idx, uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_render_keyframe(uint32_t track_idx, uint32_t ts_cts, uint32_t ts_fer, uint32_t ts_ferc, uint32_t ts_pir,
+                        uint8_t* buf, uint32_t cap, uint32_t* written, bpm_keyframe_t* layout);
+int bpm_render_keyframe64(uint32_t track_idx, int64_t ts_cts, int64_t ts_fer, int64_t ts_ferc, int64_t ts_pir,
+                          uint8_t* buf, uint32_t cap, uint32_t* written, bpm_keyframe_t* layout);
+int bpm_render_keyframe_frame(uint32_t track_idx, uint64_t frame_id,
+                              uint8_t* buf, uint32_t cap, uint32_t* written, bpm_keyframe_t* layout);
+int bpm_render_sei_nal(int codec, int framing, uint32_t track_idx,
+                       int64_t ts_cts, int64_t ts_fer, int64_t ts_ferc, int64_t ts_pir,
+                       uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_render_sei_nal_frame(int codec, int framing, uint32_t track_idx, uint64_t frame_id,
+                             uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_begin_epoch(uint64_t pts);
+int bpm_render_keyframe_epoch(uint32_t track_idx, uint64_t pts, uint8_t* buf, uint32_t cap, uint32_t* written,
+                              bpm_keyframe_t* layout);
+int bpm_render_sei_nal_epoch(int codec, int framing, uint32_t track_idx, uint64_t pts,
+                             uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_set_timestamp_clock(int clock);
+int bpm_set_timestamp_type(int ts_type);
+void bpm_set_local_counters(int enabled);
+void bpm_set_shared_sm(int enabled);
+void bpm_set_track_rates(int enabled);
+void bpm_set_drop_attribution(int enabled);
+int64_t bpm_clock_monotonic_ns(void);
 void bpm_destroy(uint8_t* data);
+int bpm_snapshot(bpm_snapshot_t* out);
+int bpm_exporter_start(const char* addr, const char* prefix, uint32_t interval_ms);
+void bpm_exporter_stop(void);
+int bpm_shm_start(const char* name, uint32_t interval_ms);
+void bpm_shm_stop(void);
+int bpm_record_start(const char* path);
+void bpm_record_stop(void);
+int64_t bpm_replay(const char* path, bpm_replay_fn callback, void* user);
+void bpm_set_fixed_time(int64_t utc_ms);
+int bpm_shm_read(const void* segment, bpm_snapshot_t* out);
+int bpm_get_stats(bpm_stats_t* out);
 void bpm_print_state(void);
 
+/* Independent sessions, NULL refers to the session of the calls above */
+bpm_session_t* bpm_session_create(void);
+void bpm_session_destroy(bpm_session_t* session);
+int bpm_session_get_track_index(bpm_session_t* session, const char* track_fingerprint);
+int bpm_session_get_track_index_hashed(bpm_session_t* session, const char* track_fingerprint, uint64_t track_fingerprint_hash);
+void bpm_session_frame_encoded(bpm_session_t* session, uint32_t track_idx);
+void bpm_session_frame_lagged(bpm_session_t* session, uint32_t track_idx);
+void bpm_session_frame_dropped(bpm_session_t* session, uint32_t track_idx);
+int bpm_session_frames_report(bpm_session_t* session, const bpm_event_t* events, size_t n);
+bpm_track_t* bpm_session_track(bpm_session_t* session, uint32_t track_idx);
+void bpm_session_bytes_dropped(bpm_session_t* session, uint32_t track_idx, uint32_t bytes);
+int bpm_session_track_rates(bpm_session_t* session, uint32_t track_idx, uint32_t window, bpm_rates_t* out);
+void bpm_session_mark_cts(bpm_session_t* session, uint32_t track_idx, uint64_t frame_id, int64_t ts);
+void bpm_session_mark_fer(bpm_session_t* session, uint32_t track_idx, uint64_t frame_id, int64_t ts);
+void bpm_session_mark_ferc(bpm_session_t* session, uint32_t track_idx, uint64_t frame_id, int64_t ts);
+void bpm_session_mark_pir(bpm_session_t* session, uint32_t track_idx, uint64_t frame_id, int64_t ts);
+int bpm_session_render_ts_ptr(bpm_session_t* session, uint32_t ts_cts, uint32_t ts_fer, uint32_t ts_ferc, uint32_t ts_pir,
+                              uint8_t** ts_data, uint32_t* ts_size);
+int bpm_session_render_ts_ptr64(bpm_session_t* session, int64_t ts_cts, int64_t ts_fer, int64_t ts_ferc, int64_t ts_pir,
+                                uint8_t** ts_data, uint32_t* ts_size);
+int bpm_session_render_sm_ptr(bpm_session_t* session, uint32_t track_idx, uint8_t** sm_data, uint32_t* sm_size);
+int bpm_session_render_erm_ptr(bpm_session_t* session, uint32_t track_idx, uint8_t** erm_data, uint32_t* erm_size);
+int bpm_session_render_ts_into(bpm_session_t* session, uint32_t ts_cts, uint32_t ts_fer, uint32_t ts_ferc, uint32_t ts_pir,
+                               uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_session_render_ts_into64(bpm_session_t* session, int64_t ts_cts, int64_t ts_fer, int64_t ts_ferc, int64_t ts_pir,
+                                 uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_session_render_ts_frame_into(bpm_session_t* session, uint32_t track_idx, uint64_t frame_id,
+                                     uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_session_render_sm_into(bpm_session_t* session, uint32_t track_idx, uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_session_render_erm_into(bpm_session_t* session, uint32_t track_idx, uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_session_render_keyframe(bpm_session_t* session, uint32_t track_idx, uint32_t ts_cts, uint32_t ts_fer, uint32_t ts_ferc, uint32_t ts_pir,
+                                uint8_t* buf, uint32_t cap, uint32_t* written, bpm_keyframe_t* layout);
+int bpm_session_render_keyframe64(bpm_session_t* session, uint32_t track_idx, int64_t ts_cts, int64_t ts_fer, int64_t ts_ferc, int64_t ts_pir,
+                                  uint8_t* buf, uint32_t cap, uint32_t* written, bpm_keyframe_t* layout);
+int bpm_session_render_keyframe_frame(bpm_session_t* session, uint32_t track_idx, uint64_t frame_id,
+                                      uint8_t* buf, uint32_t cap, uint32_t* written, bpm_keyframe_t* layout);
+int bpm_session_render_sei_nal(bpm_session_t* session, int codec, int framing, uint32_t track_idx,
+                               int64_t ts_cts, int64_t ts_fer, int64_t ts_ferc, int64_t ts_pir,
+                               uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_session_render_sei_nal_frame(bpm_session_t* session, int codec, int framing, uint32_t track_idx, uint64_t frame_id,
+                                     uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_session_begin_epoch(bpm_session_t* session, uint64_t pts);
+int bpm_session_render_keyframe_epoch(bpm_session_t* session, uint32_t track_idx, uint64_t pts,
+                                      uint8_t* buf, uint32_t cap, uint32_t* written, bpm_keyframe_t* layout);
+int bpm_session_render_sei_nal_epoch(bpm_session_t* session, int codec, int framing, uint32_t track_idx, uint64_t pts,
+                                     uint8_t* buf, uint32_t cap, uint32_t* written);
+int bpm_session_set_timestamp_clock(bpm_session_t* session, int clock);
+int bpm_session_set_timestamp_type(bpm_session_t* session, int ts_type);
+void bpm_session_set_local_counters(bpm_session_t* session, int enabled);
+void bpm_session_set_shared_sm(bpm_session_t* session, int enabled);
+void bpm_session_set_track_rates(bpm_session_t* session, int enabled);
+void bpm_session_set_drop_attribution(bpm_session_t* session, int enabled);
+int bpm_session_snapshot(bpm_session_t* session, bpm_snapshot_t* out);
+int bpm_session_exporter_start(bpm_session_t* session, const char* addr, const char* prefix, uint32_t interval_ms);
+void bpm_session_exporter_stop(bpm_session_t* session);
+int bpm_session_shm_start(bpm_session_t* session, const char* name, uint32_t interval_ms);
+void bpm_session_shm_stop(bpm_session_t* session);
+int bpm_session_record_start(bpm_session_t* session, const char* path);
+void bpm_session_record_stop(bpm_session_t* session);
+int64_t bpm_session_replay(bpm_session_t* session, const char* path, bpm_replay_fn callback, void* user);
+void bpm_session_set_fixed_time(bpm_session_t* session, int64_t utc_ms);
+void bpm_session_print_state(bpm_session_t* session);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,233 @@
+#ifndef BPM_HPP
+#define BPM_HPP
+
+// Header-only C++20 wrapper of bpm.h: RAII payloads, span-based renders into
+// stack buffers and compile-time track handles. Everything inlines to the C calls.
+
+#include "bpm.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+
+namespace bpm {
+
+inline constexpr std::size_t ts_size = BPM_TS_SIZE;
+inline constexpr std::size_t sm_size = BPM_SM_SIZE;
+inline constexpr std::size_t erm_size = BPM_ERM_SIZE;
+inline constexpr std::size_t keyframe_size = BPM_KEYFRAME_SIZE;
+inline constexpr std::size_t sei_max_size = BPM_SEI_MAX_SIZE;
+
+// Stack buffers that always fit the payloads
+using TsBuffer = std::array<uint8_t, ts_size>;
+using SmBuffer = std::array<uint8_t, sm_size>;
+using ErmBuffer = std::array<uint8_t, erm_size>;
+using KeyframeBuffer = std::array<uint8_t, keyframe_size>;
+using SeiBuffer = std::array<uint8_t, sei_max_size>;
+
+// Event timestamps on the session clock, 0 for current time
+struct Timestamps {
+    int64_t cts = 0;
+    int64_t fer = 0;
+    int64_t ferc = 0;
+    int64_t pir = 0;
+};
+
+// Payload allocated by a bpm_render_*_ptr call, freed with bpm_destroy
+class Payload {
+public:
+    Payload() noexcept = default;
+    Payload(uint8_t* data, uint32_t size) noexcept : data_(data), size_(size) {}
+    Payload(Payload&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+    Payload& operator=(Payload&& other) noexcept {
+        if (this != &other) {
+            reset();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+    Payload(const Payload&) = delete;
+    Payload& operator=(const Payload&) = delete;
+    ~Payload() { reset(); }
+
+    const uint8_t* data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    std::span<const uint8_t> bytes() const noexcept { return {data_, size_}; }
+    explicit operator bool() const noexcept { return data_ != nullptr; }
+
+private:
+    void reset() noexcept {
+        if (data_) {
+            bpm_destroy(data_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    uint8_t* data_ = nullptr;
+    uint32_t size_ = 0;
+};
+
+// Offsets of the payloads in a rendered keyframe bundle
+struct Keyframe {
+    std::span<uint8_t> ts;
+    std::span<uint8_t> sm;
+    std::span<uint8_t> erm;
+
+    explicit operator bool() const noexcept { return !ts.empty(); }
+};
+
+namespace detail {
+
+inline std::span<uint8_t> written(std::span<uint8_t> buf, int result, uint32_t size) noexcept {
+    return result == 0 ? buf.first(size) : std::span<uint8_t>();
+}
+
+inline Keyframe keyframe(std::span<uint8_t> buf, int result, const bpm_keyframe_t& layout) noexcept {
+    if (result != 0) {
+        return {};
+    }
+    return {buf.subspan(layout.ts_offset, layout.ts_size),
+            buf.subspan(layout.sm_offset, layout.sm_size),
+            buf.subspan(layout.erm_offset, layout.erm_size)};
+}
+
+inline uint32_t cap(std::span<uint8_t> buf) noexcept {
+    return buf.size() > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(buf.size());
+}
+
+} // namespace detail
+
+// Independent session, destroyed with the object. default_session() refers to the session of the
+// calls without a handle, as does a moved-from Session.
+class Session {
+public:
+    Session() noexcept : session_(bpm_session_create()) {}
+    Session(Session&& other) noexcept : session_(std::exchange(other.session_, nullptr)) {}
+    Session& operator=(Session&& other) noexcept {
+        if (this != &other) {
+            bpm_session_destroy(session_);
+            session_ = std::exchange(other.session_, nullptr);
+        }
+        return *this;
+    }
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+    ~Session() { bpm_session_destroy(session_); }
+
+    bpm_session_t* handle() const noexcept { return session_; }
+
+    int track_index(const char* fingerprint) const noexcept {
+        return bpm_session_get_track_index(session_, fingerprint);
+    }
+
+    void frame_encoded(uint32_t track_idx) const noexcept { bpm_session_frame_encoded(session_, track_idx); }
+    void frame_lagged(uint32_t track_idx) const noexcept { bpm_session_frame_lagged(session_, track_idx); }
+    void frame_dropped(uint32_t track_idx) const noexcept { bpm_session_frame_dropped(session_, track_idx); }
+    void bytes_dropped(uint32_t track_idx, uint32_t bytes) const noexcept {
+        bpm_session_bytes_dropped(session_, track_idx, bytes);
+    }
+
+    Payload render_ts(const Timestamps& ts = {}) const noexcept {
+        uint8_t* data = nullptr;
+        uint32_t size = 0;
+        if (bpm_session_render_ts_ptr64(session_, ts.cts, ts.fer, ts.ferc, ts.pir, &data, &size) != 0) {
+            return {};
+        }
+        return {data, size};
+    }
+
+    Payload render_sm(uint32_t track_idx) const noexcept {
+        uint8_t* data = nullptr;
+        uint32_t size = 0;
+        if (bpm_session_render_sm_ptr(session_, track_idx, &data, &size) != 0) {
+            return {};
+        }
+        return {data, size};
+    }
+
+    Payload render_erm(uint32_t track_idx) const noexcept {
+        uint8_t* data = nullptr;
+        uint32_t size = 0;
+        if (bpm_session_render_erm_ptr(session_, track_idx, &data, &size) != 0) {
+            return {};
+        }
+        return {data, size};
+    }
+
+    // Renders into caller buffers return the written bytes, empty on error
+    std::span<uint8_t> render_ts_into(std::span<uint8_t> buf, const Timestamps& ts = {}) const noexcept {
+        uint32_t size = 0;
+        int result = bpm_session_render_ts_into64(session_, ts.cts, ts.fer, ts.ferc, ts.pir,
+                                                  buf.data(), detail::cap(buf), &size);
+        return detail::written(buf, result, size);
+    }
+
+    std::span<uint8_t> render_sm_into(uint32_t track_idx, std::span<uint8_t> buf) const noexcept {
+        uint32_t size = 0;
+        int result = bpm_session_render_sm_into(session_, track_idx, buf.data(), detail::cap(buf), &size);
+        return detail::written(buf, result, size);
+    }
+
+    std::span<uint8_t> render_erm_into(uint32_t track_idx, std::span<uint8_t> buf) const noexcept {
+        uint32_t size = 0;
+        int result = bpm_session_render_erm_into(session_, track_idx, buf.data(), detail::cap(buf), &size);
+        return detail::written(buf, result, size);
+    }
+
+    Keyframe render_keyframe(uint32_t track_idx, std::span<uint8_t> buf, const Timestamps& ts = {}) const noexcept {
+        uint32_t size = 0;
+        bpm_keyframe_t layout{};
+        int result = bpm_session_render_keyframe64(session_, track_idx, ts.cts, ts.fer, ts.ferc, ts.pir,
+                                                   buf.data(), detail::cap(buf), &size, &layout);
+        return detail::keyframe(buf, result, layout);
+    }
+
+    std::span<uint8_t> render_sei_nal(int codec, int framing, uint32_t track_idx, std::span<uint8_t> buf,
+                                      const Timestamps& ts = {}) const noexcept {
+        uint32_t size = 0;
+        int result = bpm_session_render_sei_nal(session_, codec, framing, track_idx, ts.cts, ts.fer, ts.ferc, ts.pir,
+                                                buf.data(), detail::cap(buf), &size);
+        return detail::written(buf, result, size);
+    }
+
+    // Session of the calls without a session handle
+    static const Session& default_session() noexcept {
+        static const Session session(nullptr);
+        return session;
+    }
+
+private:
+    explicit Session(bpm_session_t* session) noexcept : session_(session) {}
+
+    bpm_session_t* session_;
+};
+
+// Counter handle of a track known at compile time, on the default session
+template <std::size_t Track>
+struct TrackHandle {
+    static_assert(Track <= UINT32_MAX, "track index out of range");
+    static constexpr uint32_t index = static_cast<uint32_t>(Track);
+
+    static void encoded() noexcept { bpm_frame_encoded(index); }
+    static void lagged() noexcept { bpm_frame_lagged(index); }
+    static void dropped() noexcept { bpm_frame_dropped(index); }
+    static void bytes_dropped(uint32_t bytes) noexcept { bpm_bytes_dropped(index, bytes); }
+
+    static void mark_cts(uint64_t frame_id, int64_t ts = 0) noexcept { bpm_mark_cts(index, frame_id, ts); }
+    static void mark_fer(uint64_t frame_id, int64_t ts = 0) noexcept { bpm_mark_fer(index, frame_id, ts); }
+    static void mark_ferc(uint64_t frame_id, int64_t ts = 0) noexcept { bpm_mark_ferc(index, frame_id, ts); }
+    static void mark_pir(uint64_t frame_id, int64_t ts = 0) noexcept { bpm_mark_pir(index, frame_id, ts); }
+
+    static Keyframe render_keyframe(std::span<uint8_t> buf, const Timestamps& ts = {}) noexcept {
+        return Session::default_session().render_keyframe(index, buf, ts);
+    }
+};
+
+} // namespace bpm
+
+#endif // BPM_HPP
@@ -35,6 +35,20 @@ void render_and_print_data(int track_idx) {
     bpm_destroy(erm_data);
 }
 
+void render_and_print_keyframe(int track_idx) {
+    // TS, SM and ERM rendered in one pass into a stack buffer
+    uint8_t data[BPM_KEYFRAME_SIZE];
+    uint32_t size = 0;
+    bpm_keyframe_t layout;
+    bpm_render_keyframe(track_idx, 0, 0, 0, 0, data, sizeof(data), &size, &layout);
+    printf("Keyframe: TS %u+%u, SM %u+%u, ERM %u+%u: ", layout.ts_offset, layout.ts_size,
+           layout.sm_offset, layout.sm_size, layout.erm_offset, layout.erm_size);
+    for (uint32_t i=0; i<size; i++) {
+        printf("0x%02X ", data[i]);
+    }
+    printf("\n");
+}
+
 int main() {
     // Two tracks
     int track0 = bpm_get_track_index("1080p60");
@@ -57,7 +71,7 @@ int main() {
             printf("\n* Frame %d\n", frame);
             bpm_print_state();
             render_and_print_data(track0);
-            render_and_print_data(track1);
+            render_and_print_keyframe(track1);
         }
     } while (frame < 1000);
     return 0;
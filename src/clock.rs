@@ -0,0 +1,81 @@
+//! Clock sources for the event timestamps passed in by the encoder
+
+pub const BPM_CLOCK_UTC_MS: i32 = 0;        // Milliseconds since the Unix epoch
+pub const BPM_CLOCK_MONOTONIC_NS: i32 = 1;  // CLOCK_MONOTONIC nanoseconds, anchored to UTC once
+
+/// The same instant on the UTC and monotonic clocks
+struct Anchor {
+    utc_ms: i64,
+    monotonic_ns: i64,
+}
+
+lazy_static::lazy_static! {
+    static ref ANCHOR: Anchor = Anchor::capture();
+}
+
+impl Anchor {
+    fn capture() -> Anchor {
+        // Midpoint of two monotonic reads around the UTC read
+        let before = monotonic_ns();
+        let utc_ms = chrono::Utc::now().timestamp_millis();
+        let after = monotonic_ns();
+        Anchor { utc_ms, monotonic_ns: before + (after - before) / 2 }
+    }
+}
+
+/// Prepare a clock for the event timestamps, anchoring the monotonic clock on first use.
+/// Returns false for an unknown clock.
+pub fn prepare(clock: i32) -> bool {
+    match clock {
+        BPM_CLOCK_UTC_MS => {},
+        BPM_CLOCK_MONOTONIC_NS => lazy_static::initialize(&ANCHOR),
+        _ => return false,
+    }
+    return true;
+}
+
+/// Event timestamp on the given clock in UTC millis
+pub fn to_utc_ms(clock: i32, timestamp: i64) -> i64 {
+    match clock {
+        BPM_CLOCK_MONOTONIC_NS => ANCHOR.utc_ms + (timestamp - ANCHOR.monotonic_ns).div_euclid(1_000_000),
+        _ => timestamp,
+    }
+}
+
+/// Event timestamp on the given clock in UTC micros, at the resolution of the clock
+pub fn to_utc_us(clock: i32, timestamp: i64) -> i64 {
+    match clock {
+        BPM_CLOCK_MONOTONIC_NS => ANCHOR.utc_ms * 1000 + (timestamp - ANCHOR.monotonic_ns).div_euclid(1000),
+        _ => timestamp.saturating_mul(1000),
+    }
+}
+
+/// Current CLOCK_MONOTONIC time in nanoseconds
+#[cfg(unix)]
+pub fn monotonic_ns() -> i64 {
+    let mut ts = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+    ts.tv_sec as i64 * 1_000_000_000 + ts.tv_nsec as i64
+}
+
+/// Monotonic milliseconds at the resolution of the scheduler tick, cheap enough for the per-frame calls
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub fn coarse_ms() -> u64 {
+    let mut ts = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC_COARSE, &mut ts) };
+    ts.tv_sec as u64 * 1000 + ts.tv_nsec as u64 / 1_000_000
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+pub fn coarse_ms() -> u64 {
+    (monotonic_ns() / 1_000_000) as u64
+}
+
+/// Current monotonic time in nanoseconds since the first call
+#[cfg(not(unix))]
+pub fn monotonic_ns() -> i64 {
+    lazy_static::lazy_static! {
+        static ref START: std::time::Instant = std::time::Instant::now();
+    }
+    START.elapsed().as_nanos() as i64
+}
@@ -0,0 +1,73 @@
+//! Keyframe bundle of a track frozen by bpm_begin_epoch for one PTS.
+//!
+//! bpm_begin_epoch renders every track under one lock with one clock read and one
+//! sum of the session counters, and stores each bundle in its track. Renders for that
+//! PTS then copy the bundle without locking. Frozen under the state lock by a single
+//! writer, read by any thread, which retries while the sequence number is odd or changes.
+
+use std::sync::atomic::{fence, AtomicU32, AtomicU64, Ordering};
+
+use crate::session::State;
+use crate::BPM_KEYFRAME_SIZE;
+
+const WORDS: usize = (BPM_KEYFRAME_SIZE + 7) / 8;
+const NO_EPOCH: u64 = u64::MAX;
+
+pub struct FrozenKeyframe {
+    seq: AtomicU32,
+    pts: AtomicU64,
+    ts_type: AtomicU32,     // Timestamp type of the payloads, which sets their layout
+    words: [AtomicU64; WORDS],
+}
+
+impl Default for FrozenKeyframe {
+    fn default() -> FrozenKeyframe {
+        FrozenKeyframe {
+            seq: AtomicU32::new(0),
+            pts: AtomicU64::new(NO_EPOCH),
+            ts_type: AtomicU32::new(0),
+            words: [const { AtomicU64::new(0) }; WORDS],
+        }
+    }
+}
+
+impl FrozenKeyframe {
+    pub fn store(&self, _state: &mut State, pts: u64, ts_type: u8, data: &[u8; BPM_KEYFRAME_SIZE]) {
+        let seq = self.seq.load(Ordering::Relaxed);
+        self.seq.store(seq.wrapping_add(1), Ordering::Relaxed);
+        fence(Ordering::Release);
+        self.pts.store(pts, Ordering::Relaxed);
+        self.ts_type.store(ts_type as u32, Ordering::Relaxed);
+        for (word, chunk) in self.words.iter().zip(data.chunks(8)) {
+            let mut bytes = [0u8; 8];
+            bytes[..chunk.len()].copy_from_slice(chunk);
+            word.store(u64::from_le_bytes(bytes), Ordering::Relaxed);
+        }
+        self.seq.store(seq.wrapping_add(2), Ordering::Release);
+    }
+
+    /// Copy the bundle frozen for pts and return its timestamp type, None if the track has no bundle for it
+    pub fn load(&self, pts: u64, data: &mut [u8; BPM_KEYFRAME_SIZE]) -> Option<u8> {
+        if pts == NO_EPOCH {
+            return None;
+        }
+        loop {
+            let seq = self.seq.load(Ordering::Acquire);
+            if seq & 1 == 0 {
+                if self.pts.load(Ordering::Relaxed) != pts {
+                    return None;
+                }
+                let ts_type = self.ts_type.load(Ordering::Relaxed) as u8;
+                for (word, chunk) in self.words.iter().zip(data.chunks_mut(8)) {
+                    let bytes = word.load(Ordering::Relaxed).to_le_bytes();
+                    chunk.copy_from_slice(&bytes[..chunk.len()]);
+                }
+                fence(Ordering::Acquire);
+                if self.seq.load(Ordering::Relaxed) == seq {
+                    return Some(ts_type);
+                }
+            }
+            std::hint::spin_loop();
+        }
+    }
+}
@@ -0,0 +1,126 @@
+//! Out-of-band export of the rendered SM/ERM deltas as StatsD counters over UDP.
+//!
+//! Renders push each delta they serialize into an SPSC queue; the state lock they hold
+//! makes them the single producer. A background thread drains the queue periodically
+//! and batches the counters into datagrams, so the renders never wait on the network.
+
+use std::fmt::Write;
+use std::net::UdpSocket;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use std::time::Duration;
+
+use crate::spsc::Spsc;
+
+const QUEUE_SIZE: usize = 1024;
+const DATAGRAM_SIZE: usize = 1432;   // Fits an Ethernet MTU with IPv6 and UDP headers
+
+pub const DELTA_SM: u8 = 0;
+pub const DELTA_ERM: u8 = 1;
+
+/// Counter deltas of one rendered SM or ERM, in payload order
+#[derive(Clone, Copy)]
+pub struct Delta {
+    pub track_idx: u32,
+    pub kind: u8,
+    pub values: [u32; 4],
+}
+
+const SM_NAMES: [&str; 4] = ["frames_rendered", "frames_lagged", "frames_dropped", "frames_output"];
+const ERM_NAMES: [&str; 3] = ["frames_input", "frames_skipped", "frames_output"];
+
+struct Shared {
+    queue: Spsc<Delta, QUEUE_SIZE>,
+    lost: AtomicU64,    // Deltas not queued because the exporter fell behind
+    stop: AtomicBool,
+}
+
+/// Running exporter, stopped and joined on drop
+pub struct Exporter {
+    shared: Arc<Shared>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl Exporter {
+    /// Start exporting to a StatsD host:port every interval_ms, with metric names starting with prefix
+    pub fn start(addr: &str, prefix: String, interval_ms: u32) -> Option<Exporter> {
+        let socket = UdpSocket::bind("0.0.0.0:0").ok()?;
+        socket.connect(addr).ok()?;
+
+        let shared = Arc::new(Shared { queue: Spsc::new(), lost: AtomicU64::new(0), stop: AtomicBool::new(false) });
+        let consumer = shared.clone();
+        let interval = Duration::from_millis(interval_ms.max(1) as u64);
+        let thread = thread::Builder::new()
+            .name("bpm-exporter".to_string())
+            .spawn(move || run(&consumer, &socket, &prefix, interval))
+            .ok()?;
+        Some(Exporter { shared, thread: Some(thread) })
+    }
+
+    /// Queue a delta, called with the session state lock held. Never blocks.
+    pub fn push(&self, delta: Delta) {
+        if !self.shared.queue.push(delta) {
+            self.shared.lost.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+impl Drop for Exporter {
+    fn drop(&mut self) {
+        self.shared.stop.store(true, Ordering::Relaxed);
+        if let Some(thread) = self.thread.take() {
+            thread.thread().unpark();
+            let _ = thread.join();
+        }
+    }
+}
+
+fn run(shared: &Shared, socket: &UdpSocket, prefix: &str, interval: Duration) {
+    let mut datagram = String::with_capacity(DATAGRAM_SIZE);
+    let mut line = String::with_capacity(128);
+    loop {
+        let stop = shared.stop.load(Ordering::Relaxed);
+
+        while let Some(delta) = shared.queue.pop() {
+            let names: &[&str] = if delta.kind == DELTA_SM { &SM_NAMES } else { &ERM_NAMES };
+            let kind = if delta.kind == DELTA_SM { "sm" } else { "erm" };
+            for (name, value) in names.iter().zip(delta.values) {
+                line.clear();
+                let _ = write!(line, "{}.track{}.{}.{}:{}|c", prefix, delta.track_idx, kind, name, value);
+                append(&mut datagram, &line, socket);
+            }
+        }
+        let lost = shared.lost.swap(0, Ordering::Relaxed);
+        if lost > 0 {
+            line.clear();
+            let _ = write!(line, "{}.export.lost:{}|c", prefix, lost);
+            append(&mut datagram, &line, socket);
+        }
+        flush(&mut datagram, socket);
+
+        if stop {
+            return;
+        }
+        thread::park_timeout(interval);
+    }
+}
+
+/// Add a metric line to the datagram, sending the datagram first if the line does not fit
+fn append(datagram: &mut String, line: &str, socket: &UdpSocket) {
+    if !datagram.is_empty() && datagram.len() + 1 + line.len() > DATAGRAM_SIZE {
+        flush(datagram, socket);
+    }
+    if !datagram.is_empty() {
+        datagram.push('\n');
+    }
+    datagram.push_str(line);
+}
+
+fn flush(datagram: &mut String, socket: &UdpSocket) {
+    if !datagram.is_empty() {
+        // Metrics are best effort, a lost datagram is not retried
+        let _ = socket.send(datagram.as_bytes());
+        datagram.clear();
+    }
+}
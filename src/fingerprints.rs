@@ -0,0 +1,115 @@
+//! Lock-free lookup of track indices by fingerprint.
+//!
+//! Registered fingerprints are kept in an open addressing table of immutable keys.
+//! Lookups hash the raw fingerprint bytes and compare them without allocating or locking.
+//! Registration inserts in place, or publishes a table of twice the size when half full.
+//! Replaced tables and all keys are kept until the index is dropped, so a concurrent lookup
+//! never sees freed memory.
+
+use parking_lot::Mutex;
+use std::ptr;
+use std::sync::atomic::{AtomicPtr, Ordering};
+
+const FNV_OFFSET_BASIS: u64 = 0xcbf2_9ce4_8422_2325;
+const FNV_PRIME: u64 = 0x0000_0100_0000_01b3;
+const MIN_SLOTS: usize = 16;
+
+/// FNV-1a 64-bit hash of a fingerprint, usable in constants for fingerprints known at build time
+pub const fn fingerprint_hash(fingerprint: &[u8]) -> u64 {
+    let mut hash = FNV_OFFSET_BASIS;
+    let mut i = 0;
+    while i < fingerprint.len() {
+        hash ^= fingerprint[i] as u64;
+        hash = hash.wrapping_mul(FNV_PRIME);
+        i += 1;
+    }
+    hash
+}
+
+struct Key {
+    hash: u64,
+    fingerprint: Box<[u8]>,
+    index: usize,
+}
+
+struct Table {
+    slots: Box<[AtomicPtr<Key>]>,   // Power of two, null if empty
+}
+
+impl Table {
+    fn new(size: usize) -> Table {
+        Table { slots: (0..size).map(|_| AtomicPtr::new(ptr::null_mut())).collect() }
+    }
+
+    fn insert(&self, key: *mut Key, hash: u64) {
+        let mask = self.slots.len() - 1;
+        let mut slot = hash as usize & mask;
+        while !self.slots[slot].load(Ordering::Relaxed).is_null() {
+            slot = (slot + 1) & mask;
+        }
+        self.slots[slot].store(key, Ordering::Release);
+    }
+}
+
+struct Owned {
+    keys: Vec<Box<Key>>,
+    tables: Vec<Box<Table>>,    // Current table last
+}
+
+pub struct FingerprintIndex {
+    table: AtomicPtr<Table>,
+    owned: Mutex<Owned>,
+}
+
+impl FingerprintIndex {
+    pub const fn new() -> FingerprintIndex {
+        FingerprintIndex {
+            table: AtomicPtr::new(ptr::null_mut()),
+            owned: Mutex::new(Owned { keys: Vec::new(), tables: Vec::new() }),
+        }
+    }
+
+    /// Track index of a registered fingerprint
+    #[inline]
+    pub fn find(&self, hash: u64, fingerprint: &[u8]) -> Option<usize> {
+        let table = self.table.load(Ordering::Acquire);
+        if table.is_null() {
+            return None;
+        }
+
+        let slots = unsafe { &(*table).slots };
+        let mask = slots.len() - 1;
+        let mut slot = hash as usize & mask;
+        loop {
+            let key = slots[slot].load(Ordering::Acquire);
+            if key.is_null() {
+                return None;
+            }
+            let key = unsafe { &*key };
+            if key.hash == hash && *key.fingerprint == *fingerprint {
+                return Some(key.index);
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    /// Add a fingerprint not registered before
+    pub fn insert(&self, fingerprint: &[u8], index: usize) {
+        let mut owned = self.owned.lock();
+        let hash = fingerprint_hash(fingerprint);
+        owned.keys.push(Box::new(Key { hash, fingerprint: fingerprint.into(), index }));
+
+        let size = owned.tables.last().map_or(0, |table| table.slots.len());
+        if owned.keys.len() * 2 > size {
+            let table = Box::new(Table::new((size * 2).max(MIN_SLOTS)));
+            for key in &owned.keys {
+                table.insert(&**key as *const Key as *mut Key, key.hash);
+            }
+            self.table.store(&*table as *const Table as *mut Table, Ordering::Release);
+            owned.tables.push(table);
+        } else {
+            let key = owned.keys.last().unwrap();
+            owned.tables.last().unwrap().insert(&**key as *const Key as *mut Key, hash);
+        }
+    }
+}
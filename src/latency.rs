@@ -0,0 +1,255 @@
+//! Encode latency of a track from the FER and FERC marks of its frames.
+//!
+//! Latencies are counted in a log-linear histogram: 8 buckets per power of two of
+//! microseconds, so a percentile is within 12.5% of the recorded value, as in HDR
+//! histograms with one significant digit. Marks add to the histogram lock-free. The
+//! ERM render of each keyframe closes an interval under the state lock and keeps the
+//! percentiles of the frames encoded since the previous keyframe for the snapshots.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use crate::session::State;
+
+const SUB_BUCKETS: u64 = 8;                     // Buckets per power of two, power of two
+const SUB_BITS: u32 = SUB_BUCKETS.trailing_zeros();
+const MAX_EXPONENT: u32 = 24;                   // Above 2^24 us = 16.7 s goes to the last bucket
+const BUCKETS: usize = ((MAX_EXPONENT - SUB_BITS + 2) as u64 * SUB_BUCKETS) as usize;
+
+/// Encode latency of the last keyframe interval
+#[derive(Clone, Copy, Default)]
+pub struct LatencySummary {
+    pub frames: u64,
+    pub p50_us: u64,
+    pub p95_us: u64,
+    pub p99_us: u64,
+}
+
+pub struct EncodeLatency {
+    counts: [AtomicU64; BUCKETS],   // Since start
+    closed: [AtomicU64; BUCKETS],   // Counts when the last interval was closed, written under the state lock
+    summary: [AtomicU64; 4],        // LatencySummary of the last interval
+}
+
+impl EncodeLatency {
+    pub const fn new() -> EncodeLatency {
+        EncodeLatency {
+            counts: [const { AtomicU64::new(0) }; BUCKETS],
+            closed: [const { AtomicU64::new(0) }; BUCKETS],
+            summary: [const { AtomicU64::new(0) }; 4],
+        }
+    }
+
+    #[inline]
+    pub fn record(&self, latency_us: u64) {
+        self.counts[bucket(latency_us)].fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// End the interval at a keyframe and summarize the latencies recorded in it
+    pub fn close_interval(&self, _state: &mut State) {
+        let mut interval = [0u64; BUCKETS];
+        for ((count, closed), value) in self.counts.iter().zip(self.closed.iter()).zip(interval.iter_mut()) {
+            let now = count.load(Ordering::Relaxed);
+            *value = now - closed.load(Ordering::Relaxed);
+            closed.store(now, Ordering::Relaxed);
+        }
+
+        let frames: u64 = interval.iter().sum();
+        let summary = [frames, percentile(&interval, frames, 50), percentile(&interval, frames, 95),
+                       percentile(&interval, frames, 99)];
+        for (slot, value) in self.summary.iter().zip(summary) {
+            slot.store(value, Ordering::Relaxed);
+        }
+    }
+
+    /// Summary of the last closed interval. Its fields may come from two intervals if a
+    /// keyframe closes one during the read.
+    pub fn summary(&self) -> LatencySummary {
+        let [frames, p50_us, p95_us, p99_us] = [0, 1, 2, 3].map(|i| self.summary[i].load(Ordering::Relaxed));
+        LatencySummary { frames, p50_us, p95_us, p99_us }
+    }
+}
+
+#[inline]
+fn bucket(us: u64) -> usize {
+    if us < SUB_BUCKETS {
+        return us as usize;
+    }
+    let exponent = u64::BITS - 1 - us.leading_zeros();
+    if exponent > MAX_EXPONENT {
+        return BUCKETS - 1;
+    }
+    let sub = (us >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+    ((exponent - SUB_BITS + 1) as u64 * SUB_BUCKETS + sub) as usize
+}
+
+/// Highest latency counted in a bucket
+fn bucket_max(bucket: usize) -> u64 {
+    let bucket = bucket as u64;
+    if bucket < SUB_BUCKETS {
+        return bucket;
+    }
+    let shift = (bucket / SUB_BUCKETS - 1) as u32;
+    ((SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << shift) - 1
+}
+
+/// Latency at or below which percent of the frames were encoded, 0 without frames
+fn percentile(counts: &[u64; BUCKETS], frames: u64, percent: u64) -> u64 {
+    let rank = (frames * percent + 99) / 100;
+    let mut seen = 0;
+    for (bucket, count) in counts.iter().enumerate() {
+        seen += count;
+        if seen >= rank && seen > 0 {
+            return bucket_max(bucket);
+        }
+    }
+    return 0;
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::session::Session;
+
+    // Lowest latency counted in a bucket
+    fn bucket_min(bucket: usize) -> u64 {
+        if bucket == 0 { 0 } else { bucket_max(bucket - 1) + 1 }
+    }
+
+    #[test]
+    fn bucket_count() {
+        assert_eq!(BUCKETS, 184);
+        assert_eq!(bucket(1 << MAX_EXPONENT), BUCKETS - SUB_BUCKETS as usize);
+    }
+
+    #[test]
+    fn linear_below_sub_buckets() {
+        for us in 0..SUB_BUCKETS {
+            assert_eq!(bucket(us), us as usize);
+            assert_eq!(bucket_max(us as usize), us);
+        }
+    }
+
+    #[test]
+    fn powers_of_two() {
+        for exponent in SUB_BITS..=MAX_EXPONENT {
+            let first = ((exponent - SUB_BITS + 1) as u64 * SUB_BUCKETS) as usize;
+            assert_eq!(bucket(1 << exponent), first, "2^{}", exponent);
+            assert_eq!(bucket((1 << exponent) - 1), first - 1, "2^{} - 1", exponent);
+            assert_eq!(bucket_min(first), 1 << exponent);
+            assert_eq!(bucket_max(first - 1), (1 << exponent) - 1);
+            // Each of the 8 sub-buckets covers an eighth of the power of two
+            let width = 1u64 << (exponent - SUB_BITS);
+            for sub in 0..SUB_BUCKETS as usize {
+                assert_eq!(bucket_max(first + sub) - bucket_min(first + sub) + 1, width);
+            }
+        }
+    }
+
+    #[test]
+    fn buckets_cover_their_values() {
+        let mut us = 0;
+        while us < 1 << (MAX_EXPONENT + 1) {
+            let b = bucket(us);
+            assert!(bucket_min(b) <= us && us <= bucket_max(b), "{} in bucket {}", us, b);
+            // Within 12.5% of the recorded value
+            assert!((bucket_max(b) - us) * SUB_BUCKETS <= us.max(1), "{} in bucket {}", us, b);
+            us += 1 + us / 61;
+        }
+    }
+
+    #[test]
+    fn top_and_overflow_bucket() {
+        let last = BUCKETS - 1;
+        assert_eq!(bucket_max(last), (1 << (MAX_EXPONENT + 1)) - 1);
+        assert_eq!(bucket(bucket_min(last)), last);
+        assert_eq!(bucket(bucket_min(last) - 1), last - 1);
+        assert_eq!(bucket((1 << (MAX_EXPONENT + 1)) - 1), last);
+        for us in [1 << (MAX_EXPONENT + 1), 1 << 40, u64::MAX].iter() {
+            assert_eq!(bucket(*us), last, "{}", us);
+        }
+    }
+
+    fn histogram(latencies: &[u64]) -> [u64; BUCKETS] {
+        let mut counts = [0; BUCKETS];
+        for us in latencies {
+            counts[bucket(*us)] += 1;
+        }
+        counts
+    }
+
+    #[test]
+    fn percentiles_of_known_distributions() {
+        assert_eq!(percentile(&[0; BUCKETS], 0, 50), 0);
+
+        // 1..=100 us, once each: p50 is 50 us, p99 is 99 us, reported as the top of their buckets
+        let uniform: Vec<u64> = (1..=100).collect();
+        let counts = histogram(&uniform);
+        assert_eq!(percentile(&counts, 100, 50), 51);
+        assert_eq!(percentile(&counts, 100, 95), 95);
+        assert_eq!(percentile(&counts, 100, 99), 103);
+        assert_eq!(percentile(&counts, 100, 100), 103);
+
+        // 98 fast frames and 2 slow ones: the slow tail shows at p99 only
+        let mut tail = vec![1000; 98];
+        tail.extend_from_slice(&[50_000, 50_000]);
+        let counts = histogram(&tail);
+        assert_eq!(percentile(&counts, 100, 50), bucket_max(bucket(1000)));
+        assert_eq!(percentile(&counts, 100, 95), bucket_max(bucket(1000)));
+        assert_eq!(percentile(&counts, 100, 99), bucket_max(bucket(50_000)));
+
+        // A single frame is every percentile
+        let counts = histogram(&[12_345]);
+        for percent in [1, 50, 99, 100].iter() {
+            assert_eq!(percentile(&counts, 1, *percent), bucket_max(bucket(12_345)));
+        }
+    }
+
+    #[test]
+    fn interval_reset_on_close() {
+        let session = Session::new();
+        let latency = EncodeLatency::new();
+        for us in 1..=100 {
+            latency.record(us);
+        }
+        latency.close_interval(&mut session.lock_state());
+        let summary = latency.summary();
+        assert_eq!((summary.frames, summary.p50_us, summary.p99_us), (100, 51, 103));
+
+        // The next interval only has the frames since
+        for _ in 0..10 {
+            latency.record(5000);
+        }
+        latency.close_interval(&mut session.lock_state());
+        let summary = latency.summary();
+        let slow = bucket_max(bucket(5000));
+        assert_eq!((summary.frames, summary.p50_us, summary.p95_us, summary.p99_us), (10, slow, slow, slow));
+
+        latency.close_interval(&mut session.lock_state());
+        let summary = latency.summary();
+        assert_eq!((summary.frames, summary.p50_us, summary.p99_us), (0, 0, 0));
+    }
+
+    #[test]
+    fn erm_render_closes_interval() {
+        let session = Session::new();
+        let session_ptr = &session as *const Session as *mut Session;
+        for frame_id in 0..4 {
+            session.mark_at(1, crate::BPM_TS_EVENT_FER, frame_id, 1_000_000);
+            session.mark_at(1, crate::BPM_TS_EVENT_FERC, frame_id, 1_000_000 + 2000 * (frame_id as i64 + 1));
+        }
+        let track = session.track(1).unwrap();
+        assert_eq!(track.latency.summary().frames, 0);
+
+        let mut erm_data = [0; crate::BPM_ERM_SIZE];
+        let mut written = 0;
+        let render = |erm_data: &mut [u8; crate::BPM_ERM_SIZE], written: &mut u32| {
+            crate::bpm_session_render_erm_into(session_ptr, 1, erm_data.as_mut_ptr(), crate::BPM_ERM_SIZE as u32, written)
+        };
+        assert_eq!(render(&mut erm_data, &mut written), 0);
+        let summary = track.latency.summary();
+        assert_eq!((summary.frames, summary.p50_us, summary.p99_us), (4, bucket_max(bucket(4000)), bucket_max(bucket(8000))));
+
+        assert_eq!(render(&mut erm_data, &mut written), 0);
+        assert_eq!(track.latency.summary().frames, 0);
+    }
+}
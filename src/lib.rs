@@ -1,16 +1,41 @@
-use parking_lot::{Mutex};
-use chrono::{DateTime, SecondsFormat, TimeDelta, TimeZone, Utc};
-use core::panic;
-use std::{ffi::CStr, os::raw::c_char, u32};
-
-const MAX_OUTPUT_VIDEO_ENCODERS: usize = 6;
+use std::{convert::TryInto, ffi::{c_void, CStr}, io::Write, os::raw::c_char, ptr, sync::atomic::Ordering, u32};
+
+mod clock;
+mod epoch;
+mod exporter;
+mod fingerprints;
+mod latency;
+mod local;
+mod marks;
+mod rates;
+mod record;
+mod rfc3339;
+mod sei;
+mod session;
+mod shm;
+mod snapshot;
+mod spsc;
+mod stats;
+mod tracks;
+use exporter::{Delta, DELTA_ERM, DELTA_SM};
+use fingerprints::fingerprint_hash;
+use record::{Record, BPM_RECORD_EPOCH, BPM_RECORD_NO_TRACK, BPM_RECORD_ERM, BPM_RECORD_FRAMES, BPM_RECORD_MARK, BPM_RECORD_SM, BPM_RECORD_TRACK, BPM_RECORD_TS};
+use rfc3339::{write_rfc3339, RFC3339_SIZE};
+use session::{BpmEvent, RenditionCounters, Session, SessionCounters, State, TrackRefs};
+use tracks::Track;
 
 const SEI_UUID_SIZE: usize = 16;
+const BPM_TS_SIZE: usize = 125;
+const BPM_SM_SIZE: usize = 65;
+const BPM_ERM_SIZE: usize = 60;
+const BPM_KEYFRAME_SIZE: usize = BPM_TS_SIZE + BPM_SM_SIZE + BPM_ERM_SIZE;
 const UUID_TS: [u8; SEI_UUID_SIZE] = [ 0x0a, 0xec, 0xff, 0xe7, 0x52, 0x72, 0x4e, 0x2f, 0xa6, 0x2f, 0xd1, 0x9c, 0xd6, 0x1a, 0x93, 0xb5 ];
 const UUID_SM: [u8; SEI_UUID_SIZE] = [ 0xca, 0x60, 0xe7, 0x1c, 0x6a, 0x8b, 0x43, 0x88, 0xa3, 0x77, 0x15, 0x1d, 0xf7, 0xbf, 0x8a, 0xc2 ];
 const UUID_ERM: [u8; SEI_UUID_SIZE] = [ 0xf1, 0xfb, 0xc1, 0xd5, 0x10, 0x1e, 0x4f, 0xb5, 0xa6, 0x1e, 0xb8, 0xce, 0x3c, 0x07, 0xb8, 0xc0 ];
 
-const TS_TYPE_RFC3339: u8 = 1;
+const TS_TYPE_RFC3339: u8 = 1;         // RFC 3339 string and a NUL
+const TS_TYPE_DURATION: u8 = 2;        // Milliseconds since the Unix epoch, 64-bit big endian
+const DURATION_SIZE: usize = 8;
 const NULL: u8 = 0;
 
 const BPM_TS_EVENT_CTS: u8 = 1;         // Composition Time Event
@@ -28,86 +53,84 @@ const BPM_ERM_FRAMES_SKIPPED: u8 = 2;   // Frames skippped by the encoder rendit
 const BPM_ERM_FRAMES_OUTPUT: u8 = 3;    // Frames output (encoded) by the encoder rendition
 
 
-struct State {
-    track_map: Vec<String>, // Track fingerprints for index in the metrics arrays
-
-    // Session metrics
-    sm_rendered: u32, // Frames rendered by compositor
-    sm_lagged: u32,   // Frames lagged by compositor
-    sm_dropped: u32,  // Frames dropped due to network congestion
-    sm_output: u32,   // Sum of all video encoder rendition sinks
 
-    // Values sent in the last metrics
-    sm_rendered_ref: Vec<u32>,
-    sm_lagged_ref: Vec<u32>,
-    sm_dropped_ref: Vec<u32>,
-    sm_output_ref: Vec<u32>,
+// Session of the calls without a session handle
+static DEFAULT_SESSION: Session = Session::new();
 
-    // Encoded Rendition Metrics
-    erm_input: Vec<u32>,   // Frames input to the encoder rendition
-    erm_skipped: Vec<u32>, // Frames skipped by the encoder rendition
-    erm_output: Vec<u32>,  // Frames output (encoded) by the encoder rendition
+/// Session behind a handle, the default session for NULL
+fn session_ref<'a>(session: *mut Session) -> &'a Session {
+    if session.is_null() {
+        &DEFAULT_SESSION
+    } else {
+        unsafe { &*session }
+    }
+}
 
-    // Values sent in the last metrics
-    erm_input_ref: Vec<u32>,
-    erm_skipped_ref: Vec<u32>,
-    erm_output_ref: Vec<u32>,
+/// Create an independent session, e.g. for each broadcast of a process.
+/// Every bpm_session_* call takes the handle, NULL refers to the session of the calls without a handle.
+/// Free with bpm_session_destroy once no other thread uses the session.
+#[no_mangle]
+pub extern "C" fn bpm_session_create() -> *mut Session {
+    Box::into_raw(Box::new(Session::new()))
 }
 
-impl Default for State {
-    fn default() -> State {
-        State {
-            track_map: Vec::new(),
+/// Free a session created with bpm_session_create
+#[no_mangle]
+pub extern "C" fn bpm_session_destroy(session: *mut Session) {
+    if !session.is_null() {
+        unsafe {
+            let _ = Box::from_raw(session);
+        }
+    }
+}
 
-            sm_rendered: 0,
-            sm_lagged: 0,
-            sm_dropped: 0,
-            sm_output: 0,
+/// Get the index for the track by track fingerprint (e.g. codec_resolution_fps).
+/// Used if the track index is not known by the encoder. Returns -1 on error.
+#[no_mangle]
+pub extern "C" fn bpm_get_track_index(track_fp: *const c_char) -> i32 {
+    get_track_index(&DEFAULT_SESSION, track_fp)
+}
 
-            sm_rendered_ref: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
-            sm_lagged_ref: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
-            sm_dropped_ref: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
-            sm_output_ref: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
+#[no_mangle]
+pub extern "C" fn bpm_session_get_track_index(session: *mut Session, track_fp: *const c_char) -> i32 {
+    get_track_index(session_ref(session), track_fp)
+}
 
-            erm_input: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
-            erm_skipped: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
-            erm_output: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
+/// Get the index for the track as in bpm_get_track_index, with the FNV-1a 64-bit hash of the
+/// fingerprint computed by the caller, e.g. at build time with bpm_fingerprint_hash.
+#[no_mangle]
+pub extern "C" fn bpm_get_track_index_hashed(track_fp: *const c_char, track_fp_hash: u64) -> i32 {
+    get_track_index_hashed(&DEFAULT_SESSION, track_fp, track_fp_hash)
+}
 
-            erm_input_ref: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
-            erm_skipped_ref: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
-            erm_output_ref: vec![0; MAX_OUTPUT_VIDEO_ENCODERS],
-        }
-    }
+#[no_mangle]
+pub extern "C" fn bpm_session_get_track_index_hashed(session: *mut Session, track_fp: *const c_char, track_fp_hash: u64) -> i32 {
+    get_track_index_hashed(session_ref(session), track_fp, track_fp_hash)
 }
 
-impl State {
-    fn get_track_index(&mut self, fingerprint: String) -> usize {
-        if let Some(index) = self.track_map.iter().position(|x| x == &fingerprint) {
-            index
-        } else {
-            if self.track_map.len() >= MAX_OUTPUT_VIDEO_ENCODERS {
-                panic!("Exceeded MAX_OUTPUT_VIDEO_ENCODERS limit");
-            }
-            self.track_map.push(fingerprint);
-            self.track_map.len() - 1
-        }
+fn get_track_index(session: &Session, track_fp: *const c_char) -> i32 {
+    if track_fp.is_null() {
+        let _ = writeln!(std::io::stderr(), "Error: Null pointer received");
+        return -1;
     }
-}
 
-// global state
-lazy_static::lazy_static! {
-    static ref STATE: Mutex<State> = Mutex::new(State::default());
+    let hash = fingerprint_hash(unsafe { CStr::from_ptr(track_fp) }.to_bytes());
+    get_track_index_hashed(session, track_fp, hash)
 }
 
+fn get_track_index_hashed(session: &Session, track_fp: *const c_char, hash: u64) -> i32 {
+    stats::count(stats::BPM_STAT_GET_TRACK_INDEX);
+    // Fast path for registered fingerprints: raw bytes, no allocation, no lock
+    if !track_fp.is_null() {
+        if let Some(track_idx) = session.find_track_index(hash, unsafe { CStr::from_ptr(track_fp) }.to_bytes()) {
+            return track_idx as i32;
+        }
+    }
 
-/// Get the index for the track by track fingerprint (e.g. codec_resolution_fps).
-/// Used if the track index is not known by the encoder.
-#[no_mangle]
-pub extern "C" fn bpm_get_track_index(track_fp: *const c_char) -> i32 {
     if let Some(track_fp_str) = c_char_to_string(track_fp) {
-        let mut state = STATE.lock();
-        let track_idx = state.get_track_index(track_fp_str);
-        return track_idx as i32;
+        if let Some(track_idx) = session.get_track_index(track_fp_str) {
+            return track_idx as i32;
+        }
     }
     return -1;
 }
@@ -115,146 +138,480 @@ pub extern "C" fn bpm_get_track_index(track_fp: *const c_char) -> i32 {
 /// Frame encoded successfully
 #[no_mangle]
 pub extern "C" fn bpm_frame_encoded(track_idx: u32) {
-    let mut state = STATE.lock();
-
-    // Spec: "The primary, highest quality video track must be packaged
-    // and sent as enhanced RTMP single-track video packets" = track 0
-    if track_idx == 0 {
-        state.sm_rendered += 1;
-    }
+    DEFAULT_SESSION.frame_encoded(track_idx);
+}
 
-    // Total frames output (sum of all video encoder rendition sinks)
-    state.sm_output += 1;
-    // Frames input to the encoder rendition
-    state.erm_input[track_idx as usize] += 1;
-    // Frames output (encoded) by the encoder rendition
-    state.erm_output[track_idx as usize] += 1;
+#[no_mangle]
+pub extern "C" fn bpm_session_frame_encoded(session: *mut Session, track_idx: u32) {
+    session_ref(session).frame_encoded(track_idx);
 }
 
 /// Frame lagged while encoding
 #[no_mangle]
 pub extern "C" fn bpm_frame_lagged(track_idx: u32) {
-    let mut state = STATE.lock();
-    state.sm_lagged += 1;
-
-    // Frames input to the encoder rendition
-    state.erm_input[track_idx as usize] += 1;
+    DEFAULT_SESSION.frame_lagged(track_idx);
+}
 
-    // Frames skipped by the encoder rendition
-    state.erm_skipped[track_idx as usize] += 1;
+#[no_mangle]
+pub extern "C" fn bpm_session_frame_lagged(session: *mut Session, track_idx: u32) {
+    session_ref(session).frame_lagged(track_idx);
 }
 
 /// Frame dropped due to network congestion
 #[no_mangle]
 pub extern "C" fn bpm_frame_dropped(track_idx: u32) {
-    let mut state = STATE.lock();
-    state.sm_dropped += 1;
+    DEFAULT_SESSION.frame_dropped(track_idx);
+}
 
-    // Frames input to the encoder rendition
-    state.erm_input[track_idx as usize] += 1;
+#[no_mangle]
+pub extern "C" fn bpm_session_frame_dropped(session: *mut Session, track_idx: u32) {
+    session_ref(session).frame_dropped(track_idx);
+}
 
-    // Frames skipped by the encoder rendition
-    state.erm_skipped[track_idx as usize] += 1;
+/// Handle of a track for the unchecked per-frame calls, NULL beyond the track table.
+/// The handle stays valid for the lifetime of the session and skips the track lookup and bounds check.
+/// Frames counted through it always go to the shared counters, renders sum them with any thread-local counts.
+#[no_mangle]
+pub extern "C" fn bpm_track(track_idx: u32) -> *const Track {
+    track_handle(&DEFAULT_SESSION, track_idx)
 }
 
-/// BPM Timestamp
-pub fn bpm_ts(ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32) -> [u8; 125] {
-    // PIR > FERC > FER > CTS
-    let cts = if ts_cts > 0 { millis_in_rfc3339(ts_cts as i64) } else { now_in_rfc3339(-3).clone() };
-    let fer = if ts_fer > 0 { millis_in_rfc3339(ts_fer as i64) } else { now_in_rfc3339(-2).clone() };
-    let ferc = if ts_ferc > 0 { millis_in_rfc3339(ts_ferc as i64) } else { now_in_rfc3339(-1).clone() };
-    let pir = if ts_pir > 0 { millis_in_rfc3339(ts_pir as i64) } else { now_in_rfc3339(0).clone() };
+#[no_mangle]
+pub extern "C" fn bpm_session_track(session: *mut Session, track_idx: u32) -> *const Track {
+    track_handle(session_ref(session), track_idx)
+}
 
-    let mut ts_data: [u8; 125] = [0; 125];
-    ts_data[0..16].copy_from_slice(&UUID_TS);
-    ts_data[16] = 0x03;                                     // ts_reserved_zero_4bits & num_timestamps_minus1
+fn track_handle(session: &Session, track_idx: u32) -> *const Track {
+    match session.track(track_idx) {
+        Some(track) => {
+            track.owner.store(session as *const Session as *mut Session, Ordering::Relaxed);
+            track.idx.store(track_idx, Ordering::Relaxed);
+            track
+        },
+        None => ptr::null(),
+    }
+}
+
+#[inline]
+unsafe fn track_add(track: *const Track, kind: u32, count: u32) {
+    let track = &*track;
+    let session = &*track.owner.load(Ordering::Relaxed);
+    session.count_frames(track, track.idx.load(Ordering::Relaxed), kind, count);
+}
+
+/// Frame encoded successfully, on a non-NULL handle from bpm_track
+#[no_mangle]
+pub unsafe extern "C" fn bpm_track_frame_encoded(track: *const Track) {
+    stats::count(stats::BPM_STAT_FRAME_ENCODED);
+    track_add(track, session::BPM_EVENT_ENCODED, 1);
+}
+
+/// Frame lagged while encoding, on a non-NULL handle from bpm_track
+#[no_mangle]
+pub unsafe extern "C" fn bpm_track_frame_lagged(track: *const Track) {
+    stats::count(stats::BPM_STAT_FRAME_LAGGED);
+    track_add(track, session::BPM_EVENT_LAGGED, 1);
+}
+
+/// Frame dropped due to network congestion, on a non-NULL handle from bpm_track
+#[no_mangle]
+pub unsafe extern "C" fn bpm_track_frame_dropped(track: *const Track) {
+    stats::count(stats::BPM_STAT_FRAME_DROPPED);
+    track_add(track, session::BPM_EVENT_DROPPED, 1);
+}
+
+/// Bytes of frames dropped due to network congestion, e.g. from the packet queue of the output,
+/// on top of the frame count of bpm_frame_dropped
+#[no_mangle]
+pub extern "C" fn bpm_bytes_dropped(track_idx: u32, bytes: u32) {
+    DEFAULT_SESSION.add_frames(track_idx, session::BPM_EVENT_BYTES_DROPPED, bytes);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_bytes_dropped(session: *mut Session, track_idx: u32, bytes: u32) {
+    session_ref(session).add_frames(track_idx, session::BPM_EVENT_BYTES_DROPPED, bytes);
+}
+
+/// Bytes dropped due to network congestion, on a non-NULL handle from bpm_track
+#[no_mangle]
+pub unsafe extern "C" fn bpm_track_bytes_dropped(track: *const Track, bytes: u32) {
+    track_add(track, session::BPM_EVENT_BYTES_DROPPED, bytes);
+}
+
+/// Frame rates of a track over a BPM_RATE_WINDOW_* ending now, for rate control between keyframes,
+/// kept after bpm_set_track_rates(1). Windows are rounded to 250 ms and cover less while the track is new. Costs the same for any window.
+/// Returns -1 for NULL or an unknown window.
+#[no_mangle]
+pub extern "C" fn bpm_track_rates(track_idx: u32, window: u32, out: *mut rates::BpmRates) -> i32 {
+    track_rates(&DEFAULT_SESSION, track_idx, window, out)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_track_rates(session: *mut Session, track_idx: u32, window: u32, out: *mut rates::BpmRates) -> i32 {
+    track_rates(session_ref(session), track_idx, window, out)
+}
+
+fn track_rates(session: &Session, track_idx: u32, window: u32, out: *mut rates::BpmRates) -> i32 {
+    if out.is_null() {
+        return -1;
+    }
+
+    match session.track_rates(track_idx, window) {
+        Some(rates) => {
+            unsafe { *out = rates };
+            0
+        },
+        None => -1,
+    }
+}
+
+/// Report a batch of frame events in one call, e.g. for encoders returning several frames at once.
+/// Returns -1 on an invalid pointer or if any event has an unknown kind or an index beyond the track table,
+/// the valid events are still applied.
+#[no_mangle]
+pub extern "C" fn bpm_frames_report(events: *const BpmEvent, n: usize) -> i32 {
+    frames_report(&DEFAULT_SESSION, events, n)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_frames_report(session: *mut Session, events: *const BpmEvent, n: usize) -> i32 {
+    frames_report(session_ref(session), events, n)
+}
+
+fn frames_report(session: &Session, events: *const BpmEvent, n: usize) -> i32 {
+    if n == 0 {
+        return 0;
+    }
+    if events.is_null() {
+        return -1;
+    }
+
+    let events = unsafe { std::slice::from_raw_parts(events, n) };
+    if session.frames_report(events) { 0 } else { -1 }
+}
+
+/// Composition Time Event of a frame, on the clock selected with bpm_set_timestamp_clock. If 0, use current time.
+#[no_mangle]
+pub extern "C" fn bpm_mark_cts(track_idx: u32, frame_id: u64, ts: i64) {
+    DEFAULT_SESSION.mark_event(track_idx, BPM_TS_EVENT_CTS, frame_id, ts);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_mark_cts(session: *mut Session, track_idx: u32, frame_id: u64, ts: i64) {
+    session_ref(session).mark_event(track_idx, BPM_TS_EVENT_CTS, frame_id, ts);
+}
+
+/// Frame Encode Request Event of a frame
+#[no_mangle]
+pub extern "C" fn bpm_mark_fer(track_idx: u32, frame_id: u64, ts: i64) {
+    DEFAULT_SESSION.mark_event(track_idx, BPM_TS_EVENT_FER, frame_id, ts);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_mark_fer(session: *mut Session, track_idx: u32, frame_id: u64, ts: i64) {
+    session_ref(session).mark_event(track_idx, BPM_TS_EVENT_FER, frame_id, ts);
+}
+
+/// Frame Encode Request Complete Event of a frame
+#[no_mangle]
+pub extern "C" fn bpm_mark_ferc(track_idx: u32, frame_id: u64, ts: i64) {
+    DEFAULT_SESSION.mark_event(track_idx, BPM_TS_EVENT_FERC, frame_id, ts);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_mark_ferc(session: *mut Session, track_idx: u32, frame_id: u64, ts: i64) {
+    session_ref(session).mark_event(track_idx, BPM_TS_EVENT_FERC, frame_id, ts);
+}
+
+/// Packet Interleave Request Event of a frame
+#[no_mangle]
+pub extern "C" fn bpm_mark_pir(track_idx: u32, frame_id: u64, ts: i64) {
+    DEFAULT_SESSION.mark_event(track_idx, BPM_TS_EVENT_PIR, frame_id, ts);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_mark_pir(session: *mut Session, track_idx: u32, frame_id: u64, ts: i64) {
+    session_ref(session).mark_event(track_idx, BPM_TS_EVENT_PIR, frame_id, ts);
+}
 
-    ts_data[17] = TS_TYPE_RFC3339;
-    ts_data[18] = BPM_TS_EVENT_CTS;                         // Composition Time Event
-    ts_data[19..43].copy_from_slice(cts.as_bytes());
-    ts_data[43] = NULL;
+/// Event timestamps of a TS payload in UTC millis. If 0, use current time.
+#[derive(Clone, Copy, Default)]
+pub struct EventTimestamps {
+    pub cts: i64,  // Composition Time
+    pub fer: i64,  // Frame Encode Request
+    pub ferc: i64, // Frame Encode Request Complete
+    pub pir: i64,  // Packet Interleave Request
+}
 
-    ts_data[44] = TS_TYPE_RFC3339;
-    ts_data[45] = BPM_TS_EVENT_FER;                         // Frame Encode Request Event
-    ts_data[46..70].copy_from_slice(fer.as_bytes());
-    ts_data[70] = NULL;
+impl EventTimestamps {
+    /// UTC millis truncated to 32 bits by the legacy API
+    fn from_u32(ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32) -> EventTimestamps {
+        EventTimestamps { cts: ts_cts as i64, fer: ts_fer as i64, ferc: ts_ferc as i64, pir: ts_pir as i64 }
+    }
 
-    ts_data[71] = TS_TYPE_RFC3339;
-    ts_data[72] = BPM_TS_EVENT_FERC;                        // Frame Encode Request Complete
-    ts_data[73..97].copy_from_slice(ferc.as_bytes());
-    ts_data[97] = NULL;
+    /// Timestamps recorded for a frame with bpm_mark_*
+    fn from_marks(session: &Session, track_idx: u32, frame_id: u64) -> EventTimestamps {
+        let [cts, fer, ferc, pir] = session.marks(track_idx, frame_id);
+        EventTimestamps { cts, fer, ferc, pir }
+    }
 
-    ts_data[98] = TS_TYPE_RFC3339;
-    ts_data[99] = BPM_TS_EVENT_PIR;                         // Packet Interleave Request Event
-    ts_data[100..124].copy_from_slice(pir.as_bytes());
-    ts_data[124] = NULL;
+    /// Timestamps on the clock selected with bpm_set_timestamp_clock
+    fn from_clock(session: &Session, ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64) -> EventTimestamps {
+        let utc_ms = |ts: i64| if ts > 0 { session.to_utc_ms(ts) } else { 0 };
+        EventTimestamps { cts: utc_ms(ts_cts), fer: utc_ms(ts_fer), ferc: utc_ms(ts_ferc), pir: utc_ms(ts_pir) }
+    }
+}
 
+/// BPM Timestamp, zero-padded after a shorter payload of another timestamp type, see bpm_ts_into
+pub fn bpm_ts(ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32) -> [u8; BPM_TS_SIZE] {
+    let mut ts_data: [u8; BPM_TS_SIZE] = [0; BPM_TS_SIZE];
+    bpm_ts_into(&mut ts_data, ts_cts, ts_fer, ts_ferc, ts_pir);
     return ts_data;
 }
 
-/// BPM Session Metrics
-pub fn bpm_sm(track_idx: u32) -> [u8; 65] {
-    let mut state = STATE.lock();
-    let now = now_in_rfc3339(0);
+/// BPM Timestamp serialized into the given buffer, returns the bytes written
+pub fn bpm_ts_into(ts_data: &mut [u8; BPM_TS_SIZE], ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32) -> usize {
+    render_ts(&DEFAULT_SESSION, ts_data, ts_cts, ts_fer, ts_ferc, ts_pir)
+}
+
+fn render_ts(session: &Session, ts_data: &mut [u8; BPM_TS_SIZE], ts_cts: u32, ts_fer: u32, ts_ferc: u32,
+             ts_pir: u32) -> usize {
+    stats::render(stats::BPM_STAT_RENDER_TS, || {
+        write_ts(ts_data, session.now_ms(), session, session.timestamp_type(), BPM_RECORD_NO_TRACK,
+                 &EventTimestamps::from_u32(ts_cts, ts_fer, ts_ferc, ts_pir))
+    })
+}
+
+// Fixed bytes of the payloads by TS_TYPE_* - 1. The writers copy a template and patch only the timestamps and counters.
+const TS_TEMPLATES: [[u8; BPM_TS_SIZE]; 2] = [ts_template(TS_TYPE_RFC3339), ts_template(TS_TYPE_DURATION)];
+const SM_TEMPLATES: [[u8; BPM_SM_SIZE]; 2] = [sm_template(TS_TYPE_RFC3339), sm_template(TS_TYPE_DURATION)];
+const ERM_TEMPLATES: [[u8; BPM_ERM_SIZE]; 2] = [erm_template(TS_TYPE_RFC3339), erm_template(TS_TYPE_DURATION)];
+
+/// Bytes of a timestamp value
+const fn timestamp_size(ts_type: u8) -> usize {
+    match ts_type {
+        TS_TYPE_DURATION => DURATION_SIZE,
+        _ => RFC3339_SIZE + 1,
+    }
+}
+
+/// Offset of timestamp i in a payload, at its type, event and value
+const fn timestamp_offset(ts_type: u8, i: usize) -> usize {
+    17 + i * (2 + timestamp_size(ts_type))
+}
+
+/// Offset of the counters of an SM or ERM, after its one timestamp, at their count
+const fn counters_offset(ts_type: u8) -> usize {
+    timestamp_offset(ts_type, 1)
+}
+
+/// Offset of the value of counter i of an SM or ERM
+const fn counter_offset(ts_type: u8, i: usize) -> usize {
+    counters_offset(ts_type) + 2 + i * 5
+}
+
+const fn ts_size(ts_type: u8) -> usize {
+    timestamp_offset(ts_type, 4)
+}
+
+const fn sm_size(ts_type: u8) -> usize {
+    counter_offset(ts_type, 4) - 1
+}
+
+const fn erm_size(ts_type: u8) -> usize {
+    counter_offset(ts_type, 3) - 1
+}
+
+const fn ts_template(ts_type: u8) -> [u8; BPM_TS_SIZE] {
+    let mut ts_data = [NULL; BPM_TS_SIZE];
+    copy_uuid(&mut ts_data, &UUID_TS);
+    ts_data[16] = 0x03;                                     // ts_reserved_zero_4bits & num_timestamps_minus1
+
+    let events = [BPM_TS_EVENT_CTS,                         // Composition Time Event
+                  BPM_TS_EVENT_FER,                         // Frame Encode Request Event
+                  BPM_TS_EVENT_FERC,                        // Frame Encode Request Complete
+                  BPM_TS_EVENT_PIR];                        // Packet Interleave Request Event
+    let mut i = 0;
+    while i < events.len() {
+        ts_data[timestamp_offset(ts_type, i)] = ts_type;
+        ts_data[timestamp_offset(ts_type, i) + 1] = events[i];
+        i += 1;
+    }
+    return ts_data;
+}
 
-    let mut sm_data: [u8; 65] = [0; 65];
-    sm_data[0..16].copy_from_slice(&UUID_SM);
+const fn sm_template(ts_type: u8) -> [u8; BPM_SM_SIZE] {
+    let mut sm_data = [NULL; BPM_SM_SIZE];
+    copy_uuid(&mut sm_data, &UUID_SM);
     sm_data[16] = 0x00;                                     // ts_reserved_zero_4bits & num_timestamps_minus1
 
-    sm_data[17] = TS_TYPE_RFC3339;
+    sm_data[17] = ts_type;
     sm_data[18] = BPM_TS_EVENT_PIR;                         // "Amazon IVS expects BPM SM SEI using timestamp_event only set to 4 (BPM_TS_EVENT_PIR)"
-    sm_data[19..43].copy_from_slice(now.as_bytes());
-    sm_data[43] = NULL;
 
-    sm_data[44] = 0x03;                                     // ts_reserved_zero_4bits & num_counters_minus1
+    sm_data[counters_offset(ts_type)] = 0x03;               // ts_reserved_zero_4bits & num_counters_minus1
+    sm_data[counter_offset(ts_type, 0) - 1] = BPM_SM_FRAMES_RENDERED;
+    sm_data[counter_offset(ts_type, 1) - 1] = BPM_SM_FRAMES_LAGGED;
+    sm_data[counter_offset(ts_type, 2) - 1] = BPM_SM_FRAMES_DROPPED;
+    sm_data[counter_offset(ts_type, 3) - 1] = BPM_SM_FRAMES_OUTPUT;
+    return sm_data;
+}
+
+const fn erm_template(ts_type: u8) -> [u8; BPM_ERM_SIZE] {
+    let mut erm_data = [NULL; BPM_ERM_SIZE];
+    copy_uuid(&mut erm_data, &UUID_ERM);
+    erm_data[16] = 0x00;                                    // ts_reserved_zero_4bits & num_timestamps_minus1
 
-    sm_data[45] = BPM_SM_FRAMES_RENDERED;
-    sm_data[46..50].copy_from_slice(&(state.sm_rendered - state.sm_rendered_ref[track_idx as usize]).to_be_bytes());
-    sm_data[50] = BPM_SM_FRAMES_LAGGED;
-    sm_data[51..55].copy_from_slice(&(state.sm_lagged - state.sm_lagged_ref[track_idx as usize]).to_be_bytes());
-    sm_data[55] = BPM_SM_FRAMES_DROPPED;
-    sm_data[56..60].copy_from_slice(&(state.sm_dropped - state.sm_dropped_ref[track_idx as usize]).to_be_bytes());
-    sm_data[60] = BPM_SM_FRAMES_OUTPUT;
-    sm_data[61..65].copy_from_slice(&(state.sm_output - state.sm_output_ref[track_idx as usize]).to_be_bytes());
+    erm_data[17] = ts_type;
+    erm_data[18] = BPM_TS_EVENT_PIR;                        // "Amazon IVS expects BPM ERM SEI using timestamp_event set only to 4 (BPM_TS_EVENT_PIR)."
 
-    state.sm_rendered_ref[track_idx as usize] = state.sm_rendered;
-    state.sm_lagged_ref[track_idx as usize] = state.sm_lagged;
-    state.sm_dropped_ref[track_idx as usize] = state.sm_dropped;
-    state.sm_output_ref[track_idx as usize] = state.sm_output;
+    erm_data[counters_offset(ts_type)] = 0x02;              // ts_reserved_zero_4bits & num_counters_minus1
+    erm_data[counter_offset(ts_type, 0) - 1] = BPM_ERM_FRAMES_INPUT;
+    erm_data[counter_offset(ts_type, 1) - 1] = BPM_ERM_FRAMES_SKIPPED;
+    erm_data[counter_offset(ts_type, 2) - 1] = BPM_ERM_FRAMES_OUTPUT;
+    return erm_data;
+}
 
-    return sm_data;
+// The RFC 3339 payloads fill the buffers, the others are shorter
+const _: () = assert!(ts_size(TS_TYPE_RFC3339) == BPM_TS_SIZE && sm_size(TS_TYPE_RFC3339) == BPM_SM_SIZE
+                      && erm_size(TS_TYPE_RFC3339) == BPM_ERM_SIZE);
+
+const fn copy_uuid(data: &mut [u8], uuid: &[u8; SEI_UUID_SIZE]) {
+    let mut i = 0;
+    while i < SEI_UUID_SIZE {
+        data[i] = uuid[i];
+        i += 1;
+    }
+}
+
+/// Index of the templates of a TS_TYPE_*
+#[inline]
+fn template_index(ts_type: u8) -> usize {
+    (ts_type == TS_TYPE_DURATION) as usize
 }
 
-/// BPM Encoded Rendition Metrics
-pub fn bpm_erm(track_idx: u32) -> [u8; 60] {
-    let mut state = STATE.lock();
-    let now = now_in_rfc3339(0);
+/// Timestamp value in UTC millis at the given offset
+#[inline]
+fn write_timestamp(data: &mut [u8], offset: usize, ts_type: u8, utc_ms: i64) {
+    match ts_type {
+        TS_TYPE_DURATION => data[offset..offset + DURATION_SIZE].copy_from_slice(&(utc_ms.max(0) as u64).to_be_bytes()),
+        _ => write_rfc3339(rfc3339_field(data, offset), utc_ms),
+    }
+}
+
+/// TS with timestamps of ts_type for a track, or BPM_RECORD_NO_TRACK if not rendered for one, returns the bytes written
+fn write_ts(ts_data: &mut [u8; BPM_TS_SIZE], now_ms: i64, session: &Session, ts_type: u8, track_idx: u32,
+            timestamps: &EventTimestamps) -> usize {
+    // PIR > FERC > FER > CTS
+    let cts = if timestamps.cts > 0 { timestamps.cts } else { now_ms - 3 };
+    let fer = if timestamps.fer > 0 { timestamps.fer } else { now_ms - 2 };
+    let ferc = if timestamps.ferc > 0 { timestamps.ferc } else { now_ms - 1 };
+    let pir = if timestamps.pir > 0 { timestamps.pir } else { now_ms };
+    session.record(|| Record::new(BPM_RECORD_TS, ts_type as u16, track_idx, [cts, fer, ferc, pir]));
+
+    *ts_data = TS_TEMPLATES[template_index(ts_type)];
+    for (i, utc_ms) in [cts, fer, ferc, pir].iter().enumerate() {
+        write_timestamp(ts_data, timestamp_offset(ts_type, i) + 2, ts_type, *utc_ms);
+    }
+    return ts_size(ts_type);
+}
 
-    let mut erm_data: [u8; 60] = [0; 60];
-    erm_data[0..16].copy_from_slice(&UUID_ERM);
-    erm_data[16] = 0x00;                                     // ts_reserved_zero_4bits & num_timestamps_minus1
+/// BPM Session Metrics, zero-padded after a shorter payload of another timestamp type, see bpm_sm_into
+pub fn bpm_sm(track_idx: u32) -> [u8; BPM_SM_SIZE] {
+    let mut sm_data: [u8; BPM_SM_SIZE] = [0; BPM_SM_SIZE];
+    bpm_sm_into(&mut sm_data, track_idx);
+    return sm_data;
+}
 
-    erm_data[17] = TS_TYPE_RFC3339;
-    erm_data[18] = BPM_TS_EVENT_PIR;                         // "Amazon IVS expects BPM ERM SEI using timestamp_event set only to 4 (BPM_TS_EVENT_PIR)."
-    erm_data[19..43].copy_from_slice(now.as_bytes());
-    erm_data[43] = NULL;
+/// BPM Session Metrics serialized into the given buffer, returns the bytes written
+pub fn bpm_sm_into(sm_data: &mut [u8; BPM_SM_SIZE], track_idx: u32) -> usize {
+    render_sm(&DEFAULT_SESSION, sm_data, track_idx)
+}
 
-    erm_data[44] = 0x02;                                     // ts_reserved_zero_4bits & num_counters_minus1
+fn render_sm(session: &Session, sm_data: &mut [u8; BPM_SM_SIZE], track_idx: u32) -> usize {
+    stats::render(stats::BPM_STAT_RENDER_SM, || {
+        let mut state = session.lock_state();
+        write_sm(sm_data, session.now_ms(), session, &mut state, session.timestamp_type(), track_idx, None)
+    })
+}
 
-    erm_data[45] = BPM_ERM_FRAMES_INPUT;
-    erm_data[46..50].copy_from_slice(&(state.erm_input[track_idx as usize] - state.erm_input_ref[track_idx as usize]).to_be_bytes());
-    erm_data[50] = BPM_ERM_FRAMES_SKIPPED;
-    erm_data[51..55].copy_from_slice(&(state.erm_skipped[track_idx as usize] - state.erm_skipped_ref[track_idx as usize]).to_be_bytes());
-    erm_data[55] = BPM_ERM_FRAMES_OUTPUT;
-    erm_data[56..60].copy_from_slice(&(state.erm_output[track_idx as usize] - state.erm_output_ref[track_idx as usize]).to_be_bytes());
+/// SM against the given session counters, or the ones of the session for the track if None
+fn write_sm(sm_data: &mut [u8; BPM_SM_SIZE], now_ms: i64, session: &Session, state: &mut State, ts_type: u8, track_idx: u32,
+            totals: Option<SessionCounters>) -> usize {
+    let sent = session.track(track_idx).map(|track| &track.sent);
+    let mut refs = sent.map(|sent| sent.load(state)).unwrap_or_default();
+    let record = || Record::new(BPM_RECORD_SM, ts_type as u16, track_idx, [now_ms, totals.is_some() as i64, 0, 0]);
+    let sm = session.recorded(record, || match totals {
+        Some(totals) => totals,
+        None => session.sm_counters(state, &refs, now_ms),
+    });
+
+    *sm_data = SM_TEMPLATES[template_index(ts_type)];
+    write_timestamp(sm_data, 19, ts_type, now_ms);
+    let deltas = [
+        emit_delta(sm.sm_rendered, &mut refs.sm_rendered),
+        emit_delta(sm.sm_lagged, &mut refs.sm_lagged),
+        emit_delta(sm.sm_dropped, &mut refs.sm_dropped),
+        emit_delta(sm.sm_output, &mut refs.sm_output),
+    ];
+    for (i, delta) in deltas.iter().enumerate() {
+        write_counter(sm_data, counter_offset(ts_type, i), *delta);
+    }
+    if let Some(exporter) = &state.exporter {
+        exporter.push(Delta { track_idx, kind: DELTA_SM, values: deltas });
+    }
 
-    state.erm_input_ref[track_idx as usize] = state.erm_input[track_idx as usize];
-    state.erm_skipped_ref[track_idx as usize] = state.erm_skipped[track_idx as usize];
-    state.erm_output_ref[track_idx as usize] = state.erm_output[track_idx as usize];
+    if let Some(sent) = sent {
+        sent.store(state, &refs);
+    }
+    return sm_size(ts_type);
+}
 
+/// BPM Encoded Rendition Metrics, zero-padded after a shorter payload of another timestamp type, see bpm_erm_into
+pub fn bpm_erm(track_idx: u32) -> [u8; BPM_ERM_SIZE] {
+    let mut erm_data: [u8; BPM_ERM_SIZE] = [0; BPM_ERM_SIZE];
+    bpm_erm_into(&mut erm_data, track_idx);
     return erm_data;
 }
 
+/// BPM Encoded Rendition Metrics serialized into the given buffer, returns the bytes written
+pub fn bpm_erm_into(erm_data: &mut [u8; BPM_ERM_SIZE], track_idx: u32) -> usize {
+    render_erm(&DEFAULT_SESSION, erm_data, track_idx)
+}
+
+fn render_erm(session: &Session, erm_data: &mut [u8; BPM_ERM_SIZE], track_idx: u32) -> usize {
+    stats::render(stats::BPM_STAT_RENDER_ERM, || {
+        let mut state = session.lock_state();
+        write_erm(erm_data, session.now_ms(), session, &mut state, session.timestamp_type(), track_idx)
+    })
+}
+
+fn write_erm(erm_data: &mut [u8; BPM_ERM_SIZE], now_ms: i64, session: &Session, state: &mut State, ts_type: u8,
+             track_idx: u32) -> usize {
+    let record = || Record::new(BPM_RECORD_ERM, ts_type as u16, track_idx, [now_ms, 0, 0, 0]);
+    let erm = session.recorded(record, || session.rendition_counters(track_idx as usize));
+    let mut refs = session.track(track_idx).map(|track| track.sent.load(state)).unwrap_or_default();
+
+    *erm_data = ERM_TEMPLATES[template_index(ts_type)];
+    write_timestamp(erm_data, 19, ts_type, now_ms);
+    let deltas = [
+        emit_delta(erm.erm_input, &mut refs.erm_input),
+        emit_delta(erm.erm_skipped, &mut refs.erm_skipped),
+        emit_delta(erm.erm_output, &mut refs.erm_output),
+    ];
+    for (i, delta) in deltas.iter().enumerate() {
+        write_counter(erm_data, counter_offset(ts_type, i), *delta);
+    }
+    if let Some(exporter) = &state.exporter {
+        exporter.push(Delta { track_idx, kind: DELTA_ERM, values: [deltas[0], deltas[1], deltas[2], 0] });
+    }
+
+    if let Some(track) = session.track(track_idx) {
+        track.sent.store(state, &refs);
+        track.latency.close_interval(state);
+    }
+    return erm_size(ts_type);
+}
+
 /// Render BPM TS data.
 ///
 /// Timestamps in UTC millis: cts=Composition Time, fer=Frame Encode Request,
@@ -264,112 +621,965 @@ pub fn bpm_erm(track_idx: u32) -> [u8; 60] {
 #[no_mangle]
 pub extern "C" fn bpm_render_ts_ptr(ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32,
                                     ts_data: *mut *mut u8, ts_size: *mut u32) -> i32 {
+    render_ts_ptr(&DEFAULT_SESSION, ts_cts, ts_fer, ts_ferc, ts_pir, ts_data, ts_size)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_ts_ptr(session: *mut Session, ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32,
+                                            ts_data: *mut *mut u8, ts_size: *mut u32) -> i32 {
+    render_ts_ptr(session_ref(session), ts_cts, ts_fer, ts_ferc, ts_pir, ts_data, ts_size)
+}
+
+fn render_ts_ptr(session: &Session, ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32,
+                 ts_data: *mut *mut u8, ts_size: *mut u32) -> i32 {
     if ts_data.is_null() || ts_size.is_null() {
         return -1;
     }
 
-    let ts = bpm_ts(ts_cts, ts_fer, ts_ferc, ts_pir);
-    let box_ptr = Box::new(ts);
-    unsafe {
-        *ts_data = Box::into_raw(box_ptr) as *mut u8;
-        *ts_size = ts.len() as u32;
+    let mut ts: [u8; BPM_TS_SIZE] = [0; BPM_TS_SIZE];
+    let size = render_ts(session, &mut ts, ts_cts, ts_fer, ts_ferc, ts_pir);
+    box_payload(&ts[..size], ts_data, ts_size)
+}
+
+/// Render BPM TS data with 64-bit timestamps on the clock selected with bpm_set_timestamp_clock
+/// (UTC millis by default). If 0, use current time.
+///
+/// Memory must be freed by the caller using bpm_destroy.
+#[no_mangle]
+pub extern "C" fn bpm_render_ts_ptr64(ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                                      ts_data: *mut *mut u8, ts_size: *mut u32) -> i32 {
+    render_ts_ptr64(&DEFAULT_SESSION, ts_cts, ts_fer, ts_ferc, ts_pir, ts_data, ts_size)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_ts_ptr64(session: *mut Session, ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                                              ts_data: *mut *mut u8, ts_size: *mut u32) -> i32 {
+    render_ts_ptr64(session_ref(session), ts_cts, ts_fer, ts_ferc, ts_pir, ts_data, ts_size)
+}
+
+fn render_ts_ptr64(session: &Session, ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                   ts_data: *mut *mut u8, ts_size: *mut u32) -> i32 {
+    if ts_data.is_null() || ts_size.is_null() {
+        return -1;
     }
 
-    return 0;
+    let mut ts: [u8; BPM_TS_SIZE] = [0; BPM_TS_SIZE];
+    let size = stats::render(stats::BPM_STAT_RENDER_TS, || {
+        write_ts(&mut ts, session.now_ms(), session, session.timestamp_type(), BPM_RECORD_NO_TRACK,
+                 &EventTimestamps::from_clock(session, ts_cts, ts_fer, ts_ferc, ts_pir))
+    });
+    box_payload(&ts[..size], ts_data, ts_size)
 }
 
 /// Render BPM SM data.
 /// Memory must be freed by the caller using bpm_destroy.
 #[no_mangle]
 pub extern "C" fn bpm_render_sm_ptr(track_idx: u32, sm_data: *mut *mut u8, sm_size: *mut u32) -> i32 {
+    render_sm_ptr(&DEFAULT_SESSION, track_idx, sm_data, sm_size)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_sm_ptr(session: *mut Session, track_idx: u32, sm_data: *mut *mut u8, sm_size: *mut u32) -> i32 {
+    render_sm_ptr(session_ref(session), track_idx, sm_data, sm_size)
+}
+
+fn render_sm_ptr(session: &Session, track_idx: u32, sm_data: *mut *mut u8, sm_size: *mut u32) -> i32 {
     if sm_data.is_null() || sm_size.is_null() {
         return -1;
     }
 
-    let sm = bpm_sm(track_idx);
-    let box_ptr = Box::new(sm);
-    unsafe {
-        *sm_data = Box::into_raw(box_ptr) as *mut u8;
-        *sm_size = sm.len() as u32;
-    }
-
-    return 0;
+    let mut sm: [u8; BPM_SM_SIZE] = [0; BPM_SM_SIZE];
+    let size = render_sm(session, &mut sm, track_idx);
+    box_payload(&sm[..size], sm_data, sm_size)
 }
 
 /// Render BPM ERM data.
 /// Memory must be freed by the caller using bpm_destroy.
 #[no_mangle]
 pub extern "C" fn bpm_render_erm_ptr(track_idx: u32, erm_data: *mut *mut u8, erm_size: *mut u32) -> i32 {
+    render_erm_ptr(&DEFAULT_SESSION, track_idx, erm_data, erm_size)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_erm_ptr(session: *mut Session, track_idx: u32, erm_data: *mut *mut u8, erm_size: *mut u32) -> i32 {
+    render_erm_ptr(session_ref(session), track_idx, erm_data, erm_size)
+}
+
+fn render_erm_ptr(session: &Session, track_idx: u32, erm_data: *mut *mut u8, erm_size: *mut u32) -> i32 {
     if erm_data.is_null() || erm_size.is_null() {
         return -1;
     }
 
-    let erm = bpm_erm(track_idx);
-    let box_ptr = Box::new(erm);
-    unsafe {
-        *erm_data = Box::into_raw(box_ptr) as *mut u8;
-        *erm_size = erm.len() as u32;
+    let mut erm: [u8; BPM_ERM_SIZE] = [0; BPM_ERM_SIZE];
+    let size = render_erm(session, &mut erm, track_idx);
+    box_payload(&erm[..size], erm_data, erm_size)
+}
+
+/// Render BPM TS data into a caller-provided buffer of at least BPM_TS_SIZE bytes.
+/// Timestamps as in bpm_render_ts_ptr. Returns -2 if cap is too small, -1 on invalid pointers.
+#[no_mangle]
+pub extern "C" fn bpm_render_ts_into(ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32,
+                                     buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_ts_into(&DEFAULT_SESSION, ts_cts, ts_fer, ts_ferc, ts_pir, buf, cap, written)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_ts_into(session: *mut Session, ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32,
+                                             buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_ts_into(session_ref(session), ts_cts, ts_fer, ts_ferc, ts_pir, buf, cap, written)
+}
+
+fn render_ts_into(session: &Session, ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32,
+                  buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    match unsafe { caller_buffer::<BPM_TS_SIZE>(buf, cap, written) } {
+        Ok(ts_data) => unsafe { *written = render_ts(session, ts_data, ts_cts, ts_fer, ts_ferc, ts_pir) as u32 },
+        Err(err) => return err,
     }
 
     return 0;
 }
 
-/// Free the memory allocated by bpm_render_ts_ptr, bpm_render_sm_ptr, or bpm_render_erm_ptr
+/// Render BPM TS data into a caller-provided buffer of at least BPM_TS_SIZE bytes.
+/// Timestamps as in bpm_render_ts_ptr64. Returns -2 if cap is too small, -1 on invalid pointers.
 #[no_mangle]
-pub extern "C" fn bpm_destroy(data: *mut u8) {
-    if !data.is_null() {
-        unsafe {
-            let _ = Box::from_raw(data);
-        }
-    }
-    else {
-        panic!("Invalid pointer received");
+pub extern "C" fn bpm_render_ts_into64(ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                                       buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_ts_into64(&DEFAULT_SESSION, ts_cts, ts_fer, ts_ferc, ts_pir, buf, cap, written)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_ts_into64(session: *mut Session, ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                                               buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_ts_into64(session_ref(session), ts_cts, ts_fer, ts_ferc, ts_pir, buf, cap, written)
+}
+
+fn render_ts_into64(session: &Session, ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                    buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    match unsafe { caller_buffer::<BPM_TS_SIZE>(buf, cap, written) } {
+        Ok(ts_data) => {
+            let size = stats::render(stats::BPM_STAT_RENDER_TS, || {
+                write_ts(ts_data, session.now_ms(), session, session.timestamp_type(), BPM_RECORD_NO_TRACK,
+                         &EventTimestamps::from_clock(session, ts_cts, ts_fer, ts_ferc, ts_pir))
+            });
+            unsafe { *written = size as u32 };
+        },
+        Err(err) => return err,
     }
+
+    return 0;
 }
 
-/// Print the state for debugging
+/// Render BPM TS data of a frame into a caller-provided buffer of at least BPM_TS_SIZE bytes.
+/// Uses the event times recorded with bpm_mark_*, current time for events not recorded.
+/// Returns -2 if cap is too small, -1 on invalid pointers.
 #[no_mangle]
-pub extern "C" fn bpm_print_state() {
-    let state = STATE.lock();
-    print!("Time: {}\n", now_in_rfc3339(0));
-    print!("Track_map: {:?}\n", state.track_map);
-    print!("SM Rendered: {}, {:?}\n", state.sm_rendered, state.sm_rendered_ref);
-    print!("SM Lagged: {}, {:?}\n", state.sm_lagged, state.sm_lagged_ref);
-    print!("SM Dropped: {}, {:?}\n", state.sm_dropped, state.sm_dropped_ref);
-    print!("SM Output: {}, {:?}\n", state.sm_output, state.sm_output_ref);
-    print!("ERM Input: {:?}, {:?}\n", state.erm_input, state.erm_input_ref);
-    print!("ERM Skipped: {:?}, {:?}\n", state.erm_skipped, state.erm_skipped_ref);
-    print!("ERM Output: {:?}, {:?}\n", state.erm_output, state.erm_output_ref);
+pub extern "C" fn bpm_render_ts_frame_into(track_idx: u32, frame_id: u64, buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_ts_frame_into(&DEFAULT_SESSION, track_idx, frame_id, buf, cap, written)
 }
 
-/// Current time in RFC 3339 format with possible offset in milliseconds
-fn now_in_rfc3339(offset_ms: i32) -> String {
-    Utc::now()
-        .checked_add_signed(TimeDelta::milliseconds(offset_ms as i64))
-        .expect("Error adding offset")
-        .to_rfc3339_opts(SecondsFormat::Millis, true)
+#[no_mangle]
+pub extern "C" fn bpm_session_render_ts_frame_into(session: *mut Session, track_idx: u32, frame_id: u64,
+                                                   buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_ts_frame_into(session_ref(session), track_idx, frame_id, buf, cap, written)
+}
+
+fn render_ts_frame_into(session: &Session, track_idx: u32, frame_id: u64, buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    match unsafe { caller_buffer::<BPM_TS_SIZE>(buf, cap, written) } {
+        Ok(ts_data) => {
+            let size = stats::render(stats::BPM_STAT_RENDER_TS, || {
+                write_ts(ts_data, session.now_ms(), session, session.timestamp_type(), track_idx,
+                         &EventTimestamps::from_marks(session, track_idx, frame_id))
+            });
+            unsafe { *written = size as u32 };
+        },
+        Err(err) => return err,
+    }
+
+    return 0;
 }
 
-/// Milliseconds in RFC 3339 format
-fn millis_in_rfc3339(timestamp_ms: i64) -> String {
-    let datetime: DateTime<Utc> = Utc.timestamp_millis_opt(timestamp_ms)
-        .single()
-        .expect("Invalid timestamp");
-    datetime.to_rfc3339_opts(SecondsFormat::Millis, true)
+/// Render BPM SM data into a caller-provided buffer of at least BPM_SM_SIZE bytes.
+/// Returns -2 if cap is too small, -1 on invalid pointers.
+#[no_mangle]
+pub extern "C" fn bpm_render_sm_into(track_idx: u32, buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_sm_into(&DEFAULT_SESSION, track_idx, buf, cap, written)
 }
 
-/// C string to a Rust string
-fn c_char_to_string(ptr: *const c_char) -> Option<String> {
-    if ptr.is_null() {
-        eprintln!("Error: Null pointer received");
-        return None;
+#[no_mangle]
+pub extern "C" fn bpm_session_render_sm_into(session: *mut Session, track_idx: u32, buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_sm_into(session_ref(session), track_idx, buf, cap, written)
+}
+
+fn render_sm_into(session: &Session, track_idx: u32, buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    match unsafe { caller_buffer::<BPM_SM_SIZE>(buf, cap, written) } {
+        Ok(sm_data) => unsafe { *written = render_sm(session, sm_data, track_idx) as u32 },
+        Err(err) => return err,
     }
 
-    unsafe { CStr::from_ptr(ptr) }
-        .to_str()
-        .map(|s| s.to_string())
-        .map_err(|_| {
-            eprintln!("Error: Invalid UTF-8 string");
-        })
+    return 0;
+}
+
+/// Render BPM ERM data into a caller-provided buffer of at least BPM_ERM_SIZE bytes.
+/// Returns -2 if cap is too small, -1 on invalid pointers.
+#[no_mangle]
+pub extern "C" fn bpm_render_erm_into(track_idx: u32, buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_erm_into(&DEFAULT_SESSION, track_idx, buf, cap, written)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_erm_into(session: *mut Session, track_idx: u32, buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_erm_into(session_ref(session), track_idx, buf, cap, written)
+}
+
+fn render_erm_into(session: &Session, track_idx: u32, buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    match unsafe { caller_buffer::<BPM_ERM_SIZE>(buf, cap, written) } {
+        Ok(erm_data) => unsafe { *written = render_erm(session, erm_data, track_idx) as u32 },
+        Err(err) => return err,
+    }
+
+    return 0;
+}
+
+/// Location of the TS, SM and ERM payloads in a keyframe bundle
+#[repr(C)]
+pub struct BpmKeyframe {
+    pub ts_offset: u32,
+    pub ts_size: u32,
+    pub sm_offset: u32,
+    pub sm_size: u32,
+    pub erm_offset: u32,
+    pub erm_size: u32,
+}
+
+/// BPM TS, SM and ERM of a keyframe serialized back to back into the given buffer.
+/// The payloads are rendered under one lock with a single clock read.
+pub fn bpm_keyframe_into(data: &mut [u8; BPM_KEYFRAME_SIZE], track_idx: u32, timestamps: &EventTimestamps) -> BpmKeyframe {
+    render_keyframe(&DEFAULT_SESSION, data, DEFAULT_SESSION.timestamp_type(), track_idx, timestamps)
+}
+
+/// Payloads of a TS_TYPE_* back to back
+const fn keyframe_layout(ts_type: u8) -> BpmKeyframe {
+    let (ts_size, sm_size, erm_size) = (ts_size(ts_type), sm_size(ts_type), erm_size(ts_type));
+    BpmKeyframe {
+        ts_offset: 0,
+        ts_size: ts_size as u32,
+        sm_offset: ts_size as u32,
+        sm_size: sm_size as u32,
+        erm_offset: (ts_size + sm_size) as u32,
+        erm_size: erm_size as u32,
+    }
+}
+
+fn render_keyframe(session: &Session, data: &mut [u8; BPM_KEYFRAME_SIZE], ts_type: u8, track_idx: u32,
+                   timestamps: &EventTimestamps) -> BpmKeyframe {
+    let mut state = session.lock_state();
+    write_keyframe(data, session.now_ms(), session, &mut state, ts_type, track_idx, timestamps, None)
+}
+
+fn write_keyframe(data: &mut [u8; BPM_KEYFRAME_SIZE], now_ms: i64, session: &Session, state: &mut State, ts_type: u8,
+                  track_idx: u32, timestamps: &EventTimestamps, totals: Option<SessionCounters>) -> BpmKeyframe {
+    // Each payload is written over the start of the space left after the previous one
+    let layout = keyframe_layout(ts_type);
+    let (sm_offset, erm_offset) = (layout.sm_offset as usize, layout.erm_offset as usize);
+    write_ts((&mut data[..BPM_TS_SIZE]).try_into().unwrap(), now_ms, session, ts_type, track_idx, timestamps);
+    write_sm((&mut data[sm_offset..sm_offset + BPM_SM_SIZE]).try_into().unwrap(), now_ms, session, state, ts_type,
+             track_idx, totals);
+    write_erm((&mut data[erm_offset..erm_offset + BPM_ERM_SIZE]).try_into().unwrap(), now_ms, session, state, ts_type,
+              track_idx);
+    return layout;
+}
+
+/// Render BPM TS, SM and ERM data of a keyframe into a caller-provided buffer of at least
+/// BPM_KEYFRAME_SIZE bytes. Offsets and sizes of the payloads are stored to layout.
+/// Timestamps as in bpm_render_ts_ptr. Returns -2 if cap is too small, -1 on invalid pointers.
+#[no_mangle]
+pub extern "C" fn bpm_render_keyframe(track_idx: u32, ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32,
+                                      buf: *mut u8, cap: u32, written: *mut u32, layout: *mut BpmKeyframe) -> i32 {
+    render_keyframe_into(&DEFAULT_SESSION, track_idx, &EventTimestamps::from_u32(ts_cts, ts_fer, ts_ferc, ts_pir),
+                         buf, cap, written, layout)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_keyframe(session: *mut Session, track_idx: u32, ts_cts: u32, ts_fer: u32, ts_ferc: u32, ts_pir: u32,
+                                              buf: *mut u8, cap: u32, written: *mut u32, layout: *mut BpmKeyframe) -> i32 {
+    render_keyframe_into(session_ref(session), track_idx, &EventTimestamps::from_u32(ts_cts, ts_fer, ts_ferc, ts_pir),
+                         buf, cap, written, layout)
+}
+
+/// Render BPM TS, SM and ERM data of a keyframe as in bpm_render_keyframe.
+/// Timestamps as in bpm_render_ts_ptr64.
+#[no_mangle]
+pub extern "C" fn bpm_render_keyframe64(track_idx: u32, ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                                        buf: *mut u8, cap: u32, written: *mut u32, layout: *mut BpmKeyframe) -> i32 {
+    let session = &DEFAULT_SESSION;
+    render_keyframe_into(session, track_idx, &EventTimestamps::from_clock(session, ts_cts, ts_fer, ts_ferc, ts_pir),
+                         buf, cap, written, layout)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_keyframe64(session: *mut Session, track_idx: u32, ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                                                buf: *mut u8, cap: u32, written: *mut u32, layout: *mut BpmKeyframe) -> i32 {
+    let session = session_ref(session);
+    render_keyframe_into(session, track_idx, &EventTimestamps::from_clock(session, ts_cts, ts_fer, ts_ferc, ts_pir),
+                         buf, cap, written, layout)
+}
+
+/// Render BPM TS, SM and ERM data of a keyframe as in bpm_render_keyframe.
+/// Timestamps as recorded for the frame with bpm_mark_*.
+#[no_mangle]
+pub extern "C" fn bpm_render_keyframe_frame(track_idx: u32, frame_id: u64,
+                                            buf: *mut u8, cap: u32, written: *mut u32, layout: *mut BpmKeyframe) -> i32 {
+    let session = &DEFAULT_SESSION;
+    render_keyframe_into(session, track_idx, &EventTimestamps::from_marks(session, track_idx, frame_id),
+                         buf, cap, written, layout)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_keyframe_frame(session: *mut Session, track_idx: u32, frame_id: u64,
+                                                    buf: *mut u8, cap: u32, written: *mut u32, layout: *mut BpmKeyframe) -> i32 {
+    let session = session_ref(session);
+    render_keyframe_into(session, track_idx, &EventTimestamps::from_marks(session, track_idx, frame_id),
+                         buf, cap, written, layout)
+}
+
+fn render_keyframe_into(session: &Session, track_idx: u32, timestamps: &EventTimestamps,
+                        buf: *mut u8, cap: u32, written: *mut u32, layout: *mut BpmKeyframe) -> i32 {
+    if layout.is_null() {
+        return -1;
+    }
+
+    match unsafe { caller_buffer::<BPM_KEYFRAME_SIZE>(buf, cap, written) } {
+        Ok(data) => {
+            let keyframe = stats::render(stats::BPM_STAT_RENDER_KEYFRAME, || {
+                render_keyframe(session, data, session.timestamp_type(), track_idx, timestamps)
+            });
+            unsafe {
+                *written = keyframe.erm_offset + keyframe.erm_size;
+                *layout = keyframe;
+            }
+        },
+        Err(err) => return err,
+    }
+
+    return 0;
+}
+
+/// Render BPM TS, SM and ERM data of a keyframe as a finished SEI NAL unit with three
+/// user_data_unregistered messages (BPM_CODEC_AVC, BPM_CODEC_HEVC), or as three metadata OBUs (BPM_CODEC_AV1).
+/// NAL units are framed with a start code (BPM_FRAMING_ANNEXB) or a 4-byte length (BPM_FRAMING_LENGTH),
+/// framing is ignored for AV1. A buffer of BPM_SEI_MAX_SIZE bytes is always large enough. A smaller one
+/// must hold the worst case with emulation prevention for the codec, checked before the metrics are
+/// rendered, so that a failed call never loses them. Timestamps as in bpm_render_ts_ptr64.
+/// Returns -2 if cap is too small, with the required size in written, -1 on invalid arguments.
+#[no_mangle]
+pub extern "C" fn bpm_render_sei_nal(codec: i32, framing: i32, track_idx: u32,
+                                     ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                                     buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    let session = &DEFAULT_SESSION;
+    render_sei_nal(session, codec, framing, track_idx, &EventTimestamps::from_clock(session, ts_cts, ts_fer, ts_ferc, ts_pir),
+                   buf, cap, written)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_sei_nal(session: *mut Session, codec: i32, framing: i32, track_idx: u32,
+                                             ts_cts: i64, ts_fer: i64, ts_ferc: i64, ts_pir: i64,
+                                             buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    let session = session_ref(session);
+    render_sei_nal(session, codec, framing, track_idx, &EventTimestamps::from_clock(session, ts_cts, ts_fer, ts_ferc, ts_pir),
+                   buf, cap, written)
+}
+
+/// Render BPM TS, SM and ERM data of a keyframe as in bpm_render_sei_nal.
+/// Timestamps as recorded for the frame with bpm_mark_*.
+#[no_mangle]
+pub extern "C" fn bpm_render_sei_nal_frame(codec: i32, framing: i32, track_idx: u32, frame_id: u64,
+                                           buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    let session = &DEFAULT_SESSION;
+    render_sei_nal(session, codec, framing, track_idx, &EventTimestamps::from_marks(session, track_idx, frame_id),
+                   buf, cap, written)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_sei_nal_frame(session: *mut Session, codec: i32, framing: i32, track_idx: u32, frame_id: u64,
+                                                   buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    let session = session_ref(session);
+    render_sei_nal(session, codec, framing, track_idx, &EventTimestamps::from_marks(session, track_idx, frame_id),
+                   buf, cap, written)
+}
+
+fn render_sei_nal(session: &Session, codec: i32, framing: i32, track_idx: u32, timestamps: &EventTimestamps,
+                  buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    if buf.is_null() || written.is_null() {
+        return -1;
+    }
+
+    stats::render(stats::BPM_STAT_RENDER_SEI, || write_sei_nal(session, codec, framing, track_idx, timestamps, buf, cap, written))
+}
+
+fn write_sei_nal(session: &Session, codec: i32, framing: i32, track_idx: u32, timestamps: &EventTimestamps,
+                 buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    // Rendering advances the metrics sent for the track, so check the arguments first
+    let ts_type = session.timestamp_type();
+    let sizes = keyframe_layout(ts_type);
+    let max_size = match sei::max_size(codec, framing, &[sizes.ts_size as usize, sizes.sm_size as usize, sizes.erm_size as usize]) {
+        Some(max_size) => max_size,
+        None => return -1,
+    };
+    if (cap as usize) < max_size {
+        unsafe { *written = max_size as u32 };
+        return -2;
+    }
+
+    let mut data: [u8; BPM_KEYFRAME_SIZE] = [0; BPM_KEYFRAME_SIZE];
+    let layout = render_keyframe(session, &mut data, ts_type, track_idx, timestamps);
+    wrap_sei_nal(&data, &layout, codec, framing, buf, cap, written)
+}
+
+/// Keyframe bundle as SEI NAL unit or OBUs into a buffer, pointers already checked
+fn wrap_sei_nal(data: &[u8; BPM_KEYFRAME_SIZE], layout: &BpmKeyframe, codec: i32, framing: i32,
+                buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    let payloads = [
+        &data[layout.ts_offset as usize..(layout.ts_offset + layout.ts_size) as usize],
+        &data[layout.sm_offset as usize..(layout.sm_offset + layout.sm_size) as usize],
+        &data[layout.erm_offset as usize..(layout.erm_offset + layout.erm_size) as usize],
+    ];
+
+    let mut out = sei::Writer::new(unsafe { std::slice::from_raw_parts_mut(buf, cap as usize) });
+    if !sei::write_payloads(&mut out, codec, framing, &payloads) {
+        return -1;
+    }
+
+    unsafe { *written = out.len() as u32 };
+    if !out.fits() {
+        return -2;
+    }
+
+    return 0;
+}
+
+/// Freeze the TS, SM and ERM of every track for the keyframe at pts, under one lock with one clock read
+/// and one sum of the session counters. The TS uses the event times recorded with bpm_mark_* for frame id pts.
+/// bpm_render_keyframe_epoch and bpm_render_sei_nal_epoch for pts then copy the frozen data without locking,
+/// so all renditions get consistent metrics for the keyframe. Returns the number of tracks frozen.
+#[no_mangle]
+pub extern "C" fn bpm_begin_epoch(pts: u64) -> i32 {
+    begin_epoch(&DEFAULT_SESSION, pts)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_begin_epoch(session: *mut Session, pts: u64) -> i32 {
+    begin_epoch(session_ref(session), pts)
+}
+
+fn begin_epoch(session: &Session, pts: u64) -> i32 {
+    let mut state = session.lock_state();
+    let now_ms = session.now_ms();
+    let ts_type = session.timestamp_type();
+    let totals = session.recorded(|| Record::new(BPM_RECORD_EPOCH, 0, 0, [pts as i64, 0, 0, 0]), || session.session_counters());
+    let mut data: [u8; BPM_KEYFRAME_SIZE] = [0; BPM_KEYFRAME_SIZE];
+    let tracks = session.tracks.len();
+    for idx in 0..tracks {
+        let track_idx = idx as u32;
+        let timestamps = EventTimestamps::from_marks(session, track_idx, pts);
+        write_keyframe(&mut data, now_ms, session, &mut state, ts_type, track_idx, &timestamps, Some(totals));
+        if let Some(track) = session.tracks.get(idx) {
+            track.epoch.store(&mut state, pts, ts_type, &data);
+        }
+    }
+    return tracks as i32;
+}
+
+/// Copy the TS, SM and ERM frozen by bpm_begin_epoch for pts into a caller-provided buffer of at least
+/// BPM_KEYFRAME_SIZE bytes, as bpm_render_keyframe. Returns -3 if no data is frozen for the track and pts,
+/// e.g. when the next epoch already began, -2 if cap is too small, -1 on invalid pointers.
+#[no_mangle]
+pub extern "C" fn bpm_render_keyframe_epoch(track_idx: u32, pts: u64, buf: *mut u8, cap: u32, written: *mut u32,
+                                            layout: *mut BpmKeyframe) -> i32 {
+    render_keyframe_epoch(&DEFAULT_SESSION, track_idx, pts, buf, cap, written, layout)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_keyframe_epoch(session: *mut Session, track_idx: u32, pts: u64,
+                                                    buf: *mut u8, cap: u32, written: *mut u32, layout: *mut BpmKeyframe) -> i32 {
+    render_keyframe_epoch(session_ref(session), track_idx, pts, buf, cap, written, layout)
+}
+
+fn render_keyframe_epoch(session: &Session, track_idx: u32, pts: u64, buf: *mut u8, cap: u32, written: *mut u32,
+                         layout: *mut BpmKeyframe) -> i32 {
+    if layout.is_null() {
+        return -1;
+    }
+
+    let data = match unsafe { caller_buffer::<BPM_KEYFRAME_SIZE>(buf, cap, written) } {
+        Ok(data) => data,
+        Err(err) => return err,
+    };
+    match session.tracks.get(track_idx as usize).and_then(|track| track.epoch.load(pts, data)) {
+        Some(ts_type) => unsafe {
+            let keyframe = keyframe_layout(ts_type);
+            *written = keyframe.erm_offset + keyframe.erm_size;
+            *layout = keyframe;
+        },
+        None => {
+            unsafe { *written = 0 };
+            return -3;
+        },
+    }
+
+    return 0;
+}
+
+/// Copy the TS, SM and ERM frozen by bpm_begin_epoch for pts as a SEI NAL unit or OBUs, as bpm_render_sei_nal.
+/// Returns -3 if no data is frozen for the track and pts, -2 if cap is too small, -1 on invalid arguments.
+#[no_mangle]
+pub extern "C" fn bpm_render_sei_nal_epoch(codec: i32, framing: i32, track_idx: u32, pts: u64,
+                                           buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_sei_nal_epoch(&DEFAULT_SESSION, codec, framing, track_idx, pts, buf, cap, written)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_render_sei_nal_epoch(session: *mut Session, codec: i32, framing: i32, track_idx: u32, pts: u64,
+                                                   buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    render_sei_nal_epoch(session_ref(session), codec, framing, track_idx, pts, buf, cap, written)
+}
+
+fn render_sei_nal_epoch(session: &Session, codec: i32, framing: i32, track_idx: u32, pts: u64,
+                        buf: *mut u8, cap: u32, written: *mut u32) -> i32 {
+    if buf.is_null() || written.is_null() {
+        return -1;
+    }
+
+    let mut data: [u8; BPM_KEYFRAME_SIZE] = [0; BPM_KEYFRAME_SIZE];
+    match session.tracks.get(track_idx as usize).and_then(|track| track.epoch.load(pts, &mut data)) {
+        Some(ts_type) => wrap_sei_nal(&data, &keyframe_layout(ts_type), codec, framing, buf, cap, written),
+        None => return -3,
+    }
+}
+
+/// Select the clock of the 64-bit timestamps: BPM_CLOCK_UTC_MS (default) or BPM_CLOCK_MONOTONIC_NS.
+/// The monotonic clock is anchored to UTC once, on the first selection. Returns -1 for an unknown clock.
+#[no_mangle]
+pub extern "C" fn bpm_set_timestamp_clock(clock: i32) -> i32 {
+    if DEFAULT_SESSION.set_timestamp_clock(clock) { 0 } else { -1 }
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_set_timestamp_clock(session: *mut Session, clock: i32) -> i32 {
+    if session_ref(session).set_timestamp_clock(clock) { 0 } else { -1 }
+}
+
+/// Select the encoding of the timestamps in the TS, SM and ERM: BPM_TS_TYPE_RFC3339 (default) or
+/// BPM_TS_TYPE_DURATION, 8-byte milliseconds since the Unix epoch, for ingests that support it.
+/// Payloads are then shorter than the BPM_*_SIZE buffers, their size is returned with them.
+/// Returns -1 for an unknown type.
+#[no_mangle]
+pub extern "C" fn bpm_set_timestamp_type(ts_type: i32) -> i32 {
+    if DEFAULT_SESSION.set_timestamp_type(ts_type) { 0 } else { -1 }
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_set_timestamp_type(session: *mut Session, ts_type: i32) -> i32 {
+    if session_ref(session).set_timestamp_type(ts_type) { 0 } else { -1 }
+}
+
+/// Count frames in counters local to each calling thread, summed only when metrics are rendered.
+/// Keeps the per-frame calls free of shared cache lines when many threads count frames.
+#[no_mangle]
+pub extern "C" fn bpm_set_local_counters(enabled: i32) {
+    DEFAULT_SESSION.set_local_counters(enabled != 0);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_set_local_counters(session: *mut Session, enabled: i32) {
+    session_ref(session).set_local_counters(enabled != 0);
+}
+
+/// Sum the session counters once per keyframe and share them between the SM renders of all tracks,
+/// instead of once per track. Each track still gets the delta since its own last SM.
+#[no_mangle]
+pub extern "C" fn bpm_set_shared_sm(enabled: i32) {
+    DEFAULT_SESSION.set_shared_sm(enabled != 0);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_set_shared_sm(session: *mut Session, enabled: i32) {
+    session_ref(session).set_shared_sm(enabled != 0);
+}
+
+/// Attribute network drops to the tracks instead of counting them as frames skipped by the encoder
+/// rendition in the ERM, for ingests that take the drops from the SM and the per-track counters.
+/// ERM frames skipped then counts lagged frames only. Select before the first ERM render.
+#[no_mangle]
+pub extern "C" fn bpm_set_drop_attribution(enabled: i32) {
+    DEFAULT_SESSION.set_drop_attribution(enabled != 0);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_set_drop_attribution(session: *mut Session, enabled: i32) {
+    session_ref(session).set_drop_attribution(enabled != 0);
+}
+
+/// Keep the frame rates of bpm_track_rates, at the cost of a coarse clock read in every frame call.
+/// Rates cover the frames counted while enabled.
+#[no_mangle]
+pub extern "C" fn bpm_set_track_rates(enabled: i32) {
+    DEFAULT_SESSION.set_rates(enabled != 0);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_set_track_rates(session: *mut Session, enabled: i32) {
+    session_ref(session).set_rates(enabled != 0);
+}
+
+/// Current CLOCK_MONOTONIC time in nanoseconds, for stamping events with BPM_CLOCK_MONOTONIC_NS
+#[no_mangle]
+pub extern "C" fn bpm_clock_monotonic_ns() -> i64 {
+    clock::monotonic_ns()
+}
+
+/// Free the memory allocated by bpm_render_ts_ptr, bpm_render_sm_ptr, or bpm_render_erm_ptr. NULL is ignored.
+#[no_mangle]
+pub extern "C" fn bpm_destroy(data: *mut u8) {
+    unsafe { libc::free(data as *mut libc::c_void) };
+}
+
+/// Copy the call counts, render latency and state lock histograms summed over all threads
+/// and sessions to out. Returns -2 if the library was built without the `stats` feature, -1 for NULL.
+#[no_mangle]
+pub extern "C" fn bpm_get_stats(out: *mut stats::BpmStats) -> i32 {
+    if out.is_null() {
+        return -1;
+    }
+
+    if stats::get(unsafe { &mut *out }) { 0 } else { -2 }
+}
+
+/// Copy the frame counters and last sent values of up to BPM_SNAPSHOT_MAX_TRACKS tracks to out,
+/// without blocking the per-frame calls or renders, e.g. for polling by a monitoring agent.
+/// Returns -1 for NULL.
+#[no_mangle]
+pub extern "C" fn bpm_snapshot(out: *mut snapshot::BpmSnapshot) -> i32 {
+    take_snapshot(&DEFAULT_SESSION, out)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_snapshot(session: *mut Session, out: *mut snapshot::BpmSnapshot) -> i32 {
+    take_snapshot(session_ref(session), out)
+}
+
+fn take_snapshot(session: &Session, out: *mut snapshot::BpmSnapshot) -> i32 {
+    if out.is_null() {
+        return -1;
+    }
+
+    snapshot::take(session, unsafe { &mut *out });
+    return 0;
+}
+
+/// Send the SM/ERM deltas of every render to a StatsD server (host:port) over UDP from a background
+/// thread, batched every interval_ms. Metric names are prefix.track<N>.sm|erm.<counter>, e.g.
+/// bpm.track0.erm.frames_output. Deltas the thread falls behind on are counted in prefix.export.lost.
+/// Replaces a running exporter. Returns -1 on invalid arguments or if the address cannot be used.
+#[no_mangle]
+pub extern "C" fn bpm_exporter_start(addr: *const c_char, prefix: *const c_char, interval_ms: u32) -> i32 {
+    exporter_start(&DEFAULT_SESSION, addr, prefix, interval_ms)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_exporter_start(session: *mut Session, addr: *const c_char, prefix: *const c_char, interval_ms: u32) -> i32 {
+    exporter_start(session_ref(session), addr, prefix, interval_ms)
+}
+
+fn exporter_start(session: &Session, addr: *const c_char, prefix: *const c_char, interval_ms: u32) -> i32 {
+    let (addr, prefix) = match (c_char_to_string(addr), c_char_to_string(prefix)) {
+        (Some(addr), Some(prefix)) => (addr, prefix),
+        _ => return -1,
+    };
+
+    if session.start_exporter(&addr, prefix, interval_ms) { 0 } else { -1 }
+}
+
+/// Stop the exporter after sending the queued deltas. Destroying a session also stops its exporter.
+#[no_mangle]
+pub extern "C" fn bpm_exporter_stop() {
+    DEFAULT_SESSION.stop_exporter();
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_exporter_stop(session: *mut Session) {
+    session_ref(session).stop_exporter();
+}
+
+/// Publish the counters of bpm_snapshot in the POSIX shared-memory segment name, e.g. "/bpm",
+/// rewritten every interval_ms by a background thread. Other processes mmap it and read it with
+/// bpm_shm_read without locking or calling into this process. Replaces a running publisher of the
+/// session. A segment left by a publisher that died is taken over. Returns -1 on invalid arguments,
+/// if another running publisher owns the segment, or if it cannot be created.
+#[no_mangle]
+pub extern "C" fn bpm_shm_start(name: *const c_char, interval_ms: u32) -> i32 {
+    shm_start(&DEFAULT_SESSION, name, interval_ms)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_shm_start(session: *mut Session, name: *const c_char, interval_ms: u32) -> i32 {
+    shm_start(session_ref(session), name, interval_ms)
+}
+
+fn shm_start(session: &Session, name: *const c_char, interval_ms: u32) -> i32 {
+    let name = match c_char_to_string(name) {
+        Some(name) => name,
+        None => return -1,
+    };
+
+    if session.start_shm(&name, interval_ms) { 0 } else { -1 }
+}
+
+/// Stop publishing and unlink the segment. Destroying a session also stops its publisher.
+#[no_mangle]
+pub extern "C" fn bpm_shm_stop() {
+    DEFAULT_SESSION.stop_shm();
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_shm_stop(session: *mut Session) {
+    session_ref(session).stop_shm();
+}
+
+/// Copy the snapshot in a segment mapped from bpm_shm_start to out, retrying while it is written.
+/// Returns -1 for NULL or a segment of another version, -3 if it is not yet written or stays
+/// mid-update, e.g. after the writer died.
+#[no_mangle]
+pub unsafe extern "C" fn bpm_shm_read(segment: *const u8, out: *mut snapshot::BpmSnapshot) -> i32 {
+    if segment.is_null() || out.is_null() {
+        return -1;
+    }
+    let header = &*(segment as *const shm::BpmShmHeader);
+    if header.magic.load(Ordering::Acquire) == shm::BPM_SHM_MAGIC && header.version != shm::BPM_SHM_VERSION {
+        return -1;
+    }
+
+    if shm::read(segment, &mut *out) { 0 } else { -3 }
+}
+
+/// Log every frame, mark and render call of the session to a binary file at path, written by a
+/// background thread. Renders are logged with the time they used, and counter updates and reads are
+/// logged in the order they happened across threads, so bpm_replay reproduces their payloads. While
+/// recording, the frame calls take the lock of the log. The tracks registered so far are logged first.
+/// Start before the first frame to replay from a fresh session. Replaces a running recording.
+/// Returns -1 on invalid arguments or if the file cannot be created.
+#[no_mangle]
+pub extern "C" fn bpm_record_start(path: *const c_char) -> i32 {
+    record_start(&DEFAULT_SESSION, path)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_record_start(session: *mut Session, path: *const c_char) -> i32 {
+    record_start(session_ref(session), path)
+}
+
+fn record_start(session: &Session, path: *const c_char) -> i32 {
+    let path = match c_char_to_string(path) {
+        Some(path) => path,
+        None => return -1,
+    };
+
+    if session.start_recording(&path) { 0 } else { -1 }
+}
+
+/// Stop the recording after writing the logged calls. Destroying a session also stops its recording.
+#[no_mangle]
+pub extern "C" fn bpm_record_stop() {
+    DEFAULT_SESSION.stop_recording();
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_record_stop(session: *mut Session) {
+    session_ref(session).stop_recording();
+}
+
+/// Called with each payload rendered by a replay, op is BPM_RECORD_TS, _SM or _ERM
+pub type ReplayCallback = extern "C" fn(user: *mut c_void, op: u32, track_idx: u32, data: *const u8, size: u32);
+
+/// Replay a log of bpm_record_start against the session as fast as possible, e.g. in a fresh session
+/// with the settings of the recorded one. Payloads are the same as recorded and passed to callback
+/// if not NULL, with BPM_RECORD_NO_TRACK for the TS renders that take no track. Returns the number of calls replayed, -1 on invalid arguments or an unreadable, truncated
+/// or corrupt log, in which case nothing is replayed.
+#[no_mangle]
+pub extern "C" fn bpm_replay(path: *const c_char, callback: Option<ReplayCallback>, user: *mut c_void) -> i64 {
+    replay(&DEFAULT_SESSION, path, callback, user)
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_replay(session: *mut Session, path: *const c_char, callback: Option<ReplayCallback>,
+                                     user: *mut c_void) -> i64 {
+    replay(session_ref(session), path, callback, user)
+}
+
+fn replay(session: &Session, path: *const c_char, callback: Option<ReplayCallback>, user: *mut c_void) -> i64 {
+    let records = match c_char_to_string(path).map(|path| record::read(&path)) {
+        Some(Ok(records)) => records,
+        _ => return -1,
+    };
+
+    let emit = |op: u16, track_idx: u32, data: &[u8]| {
+        if let Some(callback) = callback {
+            callback(user, op as u32, track_idx, data.as_ptr(), data.len() as u32);
+        }
+    };
+    // Session counters of the last epoch, for the SM rendered against them
+    let mut epoch_totals = None;
+    for record in &records {
+        let [a, b, c, d] = record.values;
+        // Renders are logged with their timestamp type
+        let ts_type = if record.event == TS_TYPE_DURATION as u16 { TS_TYPE_DURATION } else { TS_TYPE_RFC3339 };
+        match record.op {
+            BPM_RECORD_FRAMES => {
+                session.add_frames(record.track_idx, record.event as u32, a as u32);
+            },
+            BPM_RECORD_MARK => session.mark_at(record.track_idx, record.event as u8, a as u64, b),
+            BPM_RECORD_TRACK => {
+                session.track(record.track_idx);
+            },
+            BPM_RECORD_EPOCH => epoch_totals = Some(session.session_counters()),
+            BPM_RECORD_TS => {
+                let mut ts_data = [0u8; BPM_TS_SIZE];
+                let timestamps = EventTimestamps { cts: a, fer: b, ferc: c, pir: d };
+                let size = write_ts(&mut ts_data, 0, session, ts_type, record.track_idx, &timestamps);
+                emit(record.op, record.track_idx, &ts_data[..size]);
+            },
+            BPM_RECORD_SM => {
+                let mut sm_data = [0u8; BPM_SM_SIZE];
+                let mut state = session.lock_state();
+                let totals = if b != 0 { Some(epoch_totals.unwrap_or_else(|| session.session_counters())) } else { None };
+                let size = write_sm(&mut sm_data, a, session, &mut state, ts_type, record.track_idx, totals);
+                drop(state);
+                emit(record.op, record.track_idx, &sm_data[..size]);
+            },
+            BPM_RECORD_ERM => {
+                let mut erm_data = [0u8; BPM_ERM_SIZE];
+                let size = write_erm(&mut erm_data, a, session, &mut session.lock_state(), ts_type, record.track_idx);
+                emit(record.op, record.track_idx, &erm_data[..size]);
+            },
+            _ => {},
+        }
+    }
+    return records.len() as i64;
+}
+
+/// Render with a fixed current time in UTC millis instead of the system clock, e.g. for reproducible
+/// payloads in tests. 0 restores the system clock.
+#[no_mangle]
+pub extern "C" fn bpm_set_fixed_time(utc_ms: i64) {
+    DEFAULT_SESSION.set_fixed_time(utc_ms);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_set_fixed_time(session: *mut Session, utc_ms: i64) {
+    session_ref(session).set_fixed_time(utc_ms);
+}
+
+/// Print the state for debugging
+#[no_mangle]
+pub extern "C" fn bpm_print_state() {
+    print_state(&DEFAULT_SESSION);
+}
+
+#[no_mangle]
+pub extern "C" fn bpm_session_print_state(session: *mut Session) {
+    print_state(session_ref(session));
+}
+
+fn print_state(session: &Session) {
+    let state = session.lock_state();
+    let sm = session.session_counters();
+    let erm: Vec<RenditionCounters> = (0..session.tracks.len()).map(|idx| session.rendition_counters(idx)).collect();
+    let sent: Vec<TrackRefs> = session.tracks.iter().map(|track| track.sent.load(&state)).collect();
+    let refs = |f: fn(&TrackRefs) -> u64| sent.iter().map(f).collect::<Vec<u64>>();
+    let counters = |f: fn(&RenditionCounters) -> u64| erm.iter().map(f).collect::<Vec<u64>>();
+    // Write errors are ignored, they must not unwind into the caller
+    let mut out = std::io::stdout().lock();
+    let _ = write!(out, "Time: {}\n", now_in_rfc3339(0));
+    let _ = write!(out, "Track_map: {:?}\n", state.track_map);
+    let _ = write!(out, "SM Rendered: {}, {:?}\n", sm.sm_rendered, refs(|x| x.sm_rendered));
+    let _ = write!(out, "SM Lagged: {}, {:?}\n", sm.sm_lagged, refs(|x| x.sm_lagged));
+    let _ = write!(out, "SM Dropped: {}, {:?}\n", sm.sm_dropped, refs(|x| x.sm_dropped));
+    let _ = write!(out, "SM Output: {}, {:?}\n", sm.sm_output, refs(|x| x.sm_output));
+    let _ = write!(out, "ERM Input: {:?}, {:?}\n", counters(|x| x.erm_input), refs(|x| x.erm_input));
+    let _ = write!(out, "ERM Skipped: {:?}, {:?}\n", counters(|x| x.erm_skipped), refs(|x| x.erm_skipped));
+    let _ = write!(out, "ERM Output: {:?}, {:?}\n", counters(|x| x.erm_output), refs(|x| x.erm_output));
+}
+
+/// Current time in RFC 3339 format with possible offset in milliseconds
+fn now_in_rfc3339(offset_ms: i32) -> String {
+    let mut formatted = [0; RFC3339_SIZE];
+    write_rfc3339(&mut formatted, DEFAULT_SESSION.now_ms() + offset_ms as i64);
+    String::from_utf8_lossy(&formatted).into_owned()
+}
+
+/// Delta of a 64-bit counter since the value last sent, saturated to the 32 bits of the payload.
+/// The sent value advances by the emitted delta only, so a saturated remainder follows in the next payload.
+#[inline]
+fn emit_delta(counter: u64, sent: &mut u64) -> u32 {
+    let delta = counter.saturating_sub(*sent).min(u32::MAX as u64);
+    *sent += delta;
+    delta as u32
+}
+
+/// Counter value in big-endian at the given offset
+#[inline]
+fn write_counter(data: &mut [u8], offset: usize, value: u32) {
+    data[offset..offset + 4].copy_from_slice(&value.to_be_bytes());
+}
+
+/// RFC 3339 timestamp field of a payload at the given offset
+fn rfc3339_field(data: &mut [u8], offset: usize) -> &mut [u8; RFC3339_SIZE] {
+    (&mut data[offset..offset + RFC3339_SIZE]).try_into().unwrap()
+}
+
+/// C string to a Rust string
+fn c_char_to_string(ptr: *const c_char) -> Option<String> {
+    if ptr.is_null() {
+        let _ = writeln!(std::io::stderr(), "Error: Null pointer received");
+        return None;
+    }
+
+    unsafe { CStr::from_ptr(ptr) }
+        .to_str()
+        .map(|s| s.to_string())
+        .map_err(|_| {
+            let _ = writeln!(std::io::stderr(), "Error: Invalid UTF-8 string");
+        })
         .ok()
-}
\ No newline at end of file
+}
+
+/// Validate a caller-provided output buffer and borrow it as a fixed-size payload.
+/// The payload size is stored to written, also when cap is too small.
+unsafe fn caller_buffer<'a, const N: usize>(buf: *mut u8, cap: u32, written: *mut u32) -> Result<&'a mut [u8; N], i32> {
+    if buf.is_null() || written.is_null() {
+        return Err(-1);
+    }
+
+    *written = N as u32;
+    if (cap as usize) < N {
+        return Err(-2);
+    }
+
+    Ok(&mut *(buf as *mut [u8; N]))
+}
+
+/// Move a rendered payload to the heap for the _ptr API, freed with bpm_destroy
+fn box_payload(payload: &[u8], data: *mut *mut u8, size: *mut u32) -> i32 {
+    // Allocated with malloc so that bpm_destroy can free a payload of any size
+    let ptr = unsafe { libc::malloc(payload.len()) as *mut u8 };
+    if ptr.is_null() {
+        return -1;
+    }
+
+    unsafe {
+        ptr::copy_nonoverlapping(payload.as_ptr(), ptr, payload.len());
+        *data = ptr;
+        *size = payload.len() as u32;
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+//! Thread-local accumulation of the per-frame counters.
+//!
+//! Each thread counting frames of a session gets its own shard of per-track counters.
+//! Only the owning thread writes a shard, so an increment is a plain load and store
+//! without a locked instruction or a cache line shared with other threads.
+//! Renders sum the shards at keyframe time. Shards of exited threads keep their
+//! counts and are handed to the next thread that starts counting.
+
+use parking_lot::Mutex;
+use std::cell::RefCell;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::sync::Arc;
+
+use crate::tracks::{TrackCounters, TrackTable};
+
+static NEXT_ID: AtomicU64 = AtomicU64::new(1);
+
+struct Shard {
+    counters: TrackTable<TrackCounters>,
+    in_use: AtomicBool, // Owned by a running thread
+}
+
+/// Shard of the current thread, released for reuse when the thread exits
+struct Local {
+    session_id: u64,
+    shard: Arc<Shard>,
+}
+
+impl Drop for Local {
+    fn drop(&mut self) {
+        self.shard.in_use.store(false, Ordering::Release);
+    }
+}
+
+thread_local! {
+    static SHARDS: RefCell<Vec<Local>> = RefCell::new(Vec::new());
+}
+
+pub struct LocalCounters {
+    id: AtomicU64,  // Unique id of the session, assigned on first use
+    shards: Mutex<Vec<Arc<Shard>>>,
+}
+
+impl LocalCounters {
+    pub const fn new() -> LocalCounters {
+        LocalCounters { id: AtomicU64::new(0), shards: Mutex::new(Vec::new()) }
+    }
+
+    /// Add to a counter of the calling thread. Returns false for an unknown kind.
+    #[inline]
+    pub fn add(&self, track_idx: usize, kind: u32, count: u32) -> bool {
+        let id = self.id();
+        SHARDS.with(|shards| {
+            let mut shards = shards.borrow_mut();
+            let shard = match shards.iter().position(|local| local.session_id == id) {
+                Some(pos) => &shards[pos].shard,
+                None => self.attach(&mut shards, id),
+            };
+            let counter = match shard.counters.get_or_insert(track_idx).and_then(|c| c.counter(kind)) {
+                Some(counter) => counter,
+                None => return false,
+            };
+            // Single writer: no read-modify-write needed
+            counter.store(counter.load(Ordering::Relaxed) + count as u64, Ordering::Relaxed);
+            true
+        })
+    }
+
+    /// Encoded, lagged and dropped frames and dropped bytes of a track summed over all shards
+    pub fn sum(&self, track_idx: usize) -> [u64; 4] {
+        let mut sum = [0u64; 4];
+        for shard in self.shards.lock().iter() {
+            if let Some(counters) = shard.counters.get(track_idx) {
+                sum[0] += counters.encoded.load(Ordering::Relaxed);
+                sum[1] += counters.lagged.load(Ordering::Relaxed);
+                sum[2] += counters.dropped.load(Ordering::Relaxed);
+                sum[3] += counters.bytes_dropped.load(Ordering::Relaxed);
+            }
+        }
+        return sum;
+    }
+
+    fn id(&self) -> u64 {
+        let id = self.id.load(Ordering::Relaxed);
+        if id != 0 {
+            return id;
+        }
+        let new_id = NEXT_ID.fetch_add(1, Ordering::Relaxed);
+        match self.id.compare_exchange(0, new_id, Ordering::Relaxed, Ordering::Relaxed) {
+            Ok(_) => new_id,
+            Err(id) => id,
+        }
+    }
+
+    #[cold]
+    fn attach<'a>(&self, locals: &'a mut Vec<Local>, id: u64) -> &'a Arc<Shard> {
+        // Forget shards of destroyed sessions, this thread holds the last reference
+        locals.retain(|local| Arc::strong_count(&local.shard) > 1);
+
+        let mut shards = self.shards.lock();
+        let claimed = shards.iter().find(|shard| {
+            shard.in_use.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed).is_ok()
+        });
+        let shard = match claimed {
+            Some(shard) => shard.clone(),
+            None => {
+                let shard = Arc::new(Shard { counters: TrackTable::new(), in_use: AtomicBool::new(true) });
+                shards.push(shard.clone());
+                shard
+            },
+        };
+        locals.push(Local { session_id: id, shard });
+        &locals.last().unwrap().shard
+    }
+}
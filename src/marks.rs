@@ -0,0 +1,62 @@
+//! Per-track ring of recorded frame event timestamps (CTS, FER, FERC, PIR) keyed by frame id.
+//! Marks and lookups are lock-free and allocation-free.
+
+use std::sync::atomic::{AtomicI64, AtomicU64, Ordering};
+
+pub const EVENT_COUNT: usize = 4;   // CTS, FER, FERC, PIR
+const RING_SIZE: usize = 64;        // Frames kept per track, power of two
+const NO_FRAME: u64 = u64::MAX;
+
+/// Timestamp of one event of one frame. The frame id is cleared while the
+/// timestamp is written, so a reader seeing the same id before and after
+/// reading the timestamp has a consistent pair.
+struct EventEntry {
+    frame_id: AtomicU64,
+    utc_us: AtomicI64,
+}
+
+impl EventEntry {
+    const fn new() -> EventEntry {
+        EventEntry { frame_id: AtomicU64::new(NO_FRAME), utc_us: AtomicI64::new(0) }
+    }
+}
+
+pub struct EventRing {
+    entries: [[EventEntry; EVENT_COUNT]; RING_SIZE],
+}
+
+impl EventRing {
+    pub const fn new() -> EventRing {
+        EventRing { entries: [const { [const { EventEntry::new() }; EVENT_COUNT] }; RING_SIZE] }
+    }
+
+    /// Record the time of an event in UTC micros, 0-based in the order CTS, FER, FERC, PIR
+    pub fn mark(&self, event: usize, frame_id: u64, utc_us: i64) {
+        let entry = &self.entries[frame_id as usize % RING_SIZE][event];
+        entry.frame_id.store(NO_FRAME, Ordering::Relaxed);
+        entry.utc_us.store(utc_us, Ordering::Release);
+        entry.frame_id.store(frame_id, Ordering::Release);
+    }
+
+    /// Recorded event times of a frame in UTC millis, 0 if not recorded or already overwritten
+    pub fn timestamps(&self, frame_id: u64) -> [i64; EVENT_COUNT] {
+        let mut timestamps = [0; EVENT_COUNT];
+        for (event, timestamp) in timestamps.iter_mut().enumerate() {
+            let utc_us = self.timestamp_us(event, frame_id);
+            if utc_us != 0 {
+                *timestamp = utc_us.div_euclid(1000);
+            }
+        }
+        return timestamps;
+    }
+
+    /// Recorded time of one event of a frame in UTC micros, 0 if not recorded or already overwritten
+    pub fn timestamp_us(&self, event: usize, frame_id: u64) -> i64 {
+        let entry = &self.entries[frame_id as usize % RING_SIZE][event];
+        if frame_id == NO_FRAME || entry.frame_id.load(Ordering::Acquire) != frame_id {
+            return 0;
+        }
+        let utc_us = entry.utc_us.load(Ordering::Acquire);
+        if entry.frame_id.load(Ordering::Acquire) == frame_id { utc_us } else { 0 }
+    }
+}
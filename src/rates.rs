@@ -0,0 +1,313 @@
+//! Frame rates of a track over sliding windows, for rate control decisions between keyframes.
+//!
+//! Time is split into buckets of BUCKET_MS. The first frame call in a bucket stores the
+//! cumulative frame counts in the ring slot of that bucket, and in those of the buckets
+//! skipped since the last call, which had the same counts. A query subtracts the slot at
+//! the start of the window from the current counts, so it costs the same for any window.
+//! Slots are written by whichever thread starts a bucket and read by any thread, which
+//! retries while the slot is being rewritten.
+
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+
+use crate::clock;
+
+pub const BPM_RATE_WINDOW_1S: u32 = 0;
+pub const BPM_RATE_WINDOW_5S: u32 = 1;
+pub const BPM_RATE_WINDOW_30S: u32 = 2;
+
+const BUCKET_MS: u64 = 250;
+const BUCKETS: usize = 128;     // 32 s of history, power of two
+const NO_BUCKET: u64 = u64::MAX;
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct BpmRates {
+    // Frames counted in the window
+    pub encoded: u64,
+    pub lagged: u64,
+    pub dropped: u64,
+
+    pub fps: f64,           // Frames encoded per second
+    pub lagged_ratio: f64,  // Lagged share of the frames input to the rendition
+    pub dropped_ratio: f64, // Dropped share of the frames input to the rendition
+    pub window_ms: u32,     // Time covered, shorter than the window while the track is new
+}
+
+struct Slot {
+    bucket: AtomicU64,      // Bucket of the counts, NO_BUCKET while written
+    counts: [AtomicU64; 3],
+}
+
+impl Slot {
+    const fn new() -> Slot {
+        Slot { bucket: AtomicU64::new(NO_BUCKET), counts: [const { AtomicU64::new(0) }; 3] }
+    }
+
+    fn store(&self, bucket: u64, counts: &[u64; 3]) {
+        self.bucket.store(NO_BUCKET, Ordering::Relaxed);
+        fence(Ordering::Release);
+        for (slot, count) in self.counts.iter().zip(counts) {
+            slot.store(*count, Ordering::Relaxed);
+        }
+        self.bucket.store(bucket, Ordering::Release);
+    }
+
+    /// Counts at the start of bucket, None if the slot holds another bucket
+    fn load(&self, bucket: u64) -> Option<[u64; 3]> {
+        loop {
+            let stored = self.bucket.load(Ordering::Acquire);
+            if stored != NO_BUCKET {
+                if stored != bucket {
+                    return None;
+                }
+                let counts = [0, 1, 2].map(|i| self.counts[i].load(Ordering::Relaxed));
+                fence(Ordering::Acquire);
+                if self.bucket.load(Ordering::Relaxed) == bucket {
+                    return Some(counts);
+                }
+            }
+            std::hint::spin_loop();
+        }
+    }
+}
+
+/// Buckets in a BPM_RATE_WINDOW_*, None for an unknown window
+fn window_buckets(window: u32) -> Option<u64> {
+    match window {
+        BPM_RATE_WINDOW_1S => Some(1000 / BUCKET_MS),
+        BPM_RATE_WINDOW_5S => Some(5000 / BUCKET_MS),
+        BPM_RATE_WINDOW_30S => Some(30000 / BUCKET_MS),
+        _ => None,
+    }
+}
+
+pub fn is_window(window: u32) -> bool {
+    window_buckets(window).is_some()
+}
+
+pub struct TrackRates {
+    first: AtomicU64,   // Bucket of the first frame call
+    last: AtomicU64,    // Latest bucket with its slot stored
+    slots: [Slot; BUCKETS],
+}
+
+impl TrackRates {
+    pub const fn new() -> TrackRates {
+        TrackRates {
+            first: AtomicU64::new(NO_BUCKET),
+            last: AtomicU64::new(NO_BUCKET),
+            slots: [const { Slot::new() }; BUCKETS],
+        }
+    }
+
+    /// Called before counting frames, with the cumulative counts of the track
+    #[inline]
+    pub fn tick(&self, counts: impl FnOnce() -> [u64; 3]) {
+        self.tick_at(clock::coarse_ms(), counts);
+    }
+
+    #[inline]
+    fn tick_at(&self, now_ms: u64, counts: impl FnOnce() -> [u64; 3]) {
+        let bucket = now_ms / BUCKET_MS;
+        let last = self.last.load(Ordering::Relaxed);
+        if last == bucket || (last != NO_BUCKET && last > bucket) {
+            return;
+        }
+        self.advance(last, bucket, counts);
+    }
+
+    #[cold]
+    fn advance(&self, last: u64, bucket: u64, counts: impl FnOnce() -> [u64; 3]) {
+        // One thread starts the bucket, the others count in it right away
+        if self.last.compare_exchange(last, bucket, Ordering::AcqRel, Ordering::Relaxed).is_err() {
+            return;
+        }
+        // Read once the bucket is won, so frames counted in the previous bucket in the meantime stay in it
+        let counts = counts();
+        let from = if last == NO_BUCKET { bucket } else { (last + 1).max(bucket.saturating_sub(BUCKETS as u64 - 1)) };
+        for skipped in from..=bucket {
+            self.slots[skipped as usize % BUCKETS].store(skipped, &counts);
+        }
+        if last == NO_BUCKET {
+            self.first.store(bucket, Ordering::Release);
+        }
+    }
+
+    /// Rates over a BPM_RATE_WINDOW_* ending now, given the current cumulative counts.
+    /// None for an unknown window.
+    pub fn query(&self, window: u32, counts: impl Fn() -> [u64; 3]) -> Option<BpmRates> {
+        self.query_at(window, clock::coarse_ms(), counts)
+    }
+
+    fn query_at(&self, window: u32, now_ms: u64, counts: impl Fn() -> [u64; 3]) -> Option<BpmRates> {
+        let window_buckets = window_buckets(window)?;
+        self.tick_at(now_ms, &counts);
+
+        let first = self.first.load(Ordering::Acquire);
+        if first == NO_BUCKET {
+            return Some(BpmRates::default());
+        }
+        let start = (now_ms / BUCKET_MS).saturating_sub(window_buckets).max(first);
+        let base = match self.slots[start as usize % BUCKETS].load(start) {
+            Some(base) => base,
+            None => return Some(BpmRates::default()),
+        };
+
+        let now = counts();
+        let [encoded, lagged, dropped] = [0, 1, 2].map(|i| now[i].saturating_sub(base[i]));
+        let elapsed_ms = now_ms.saturating_sub(start * BUCKET_MS).max(1);
+        let input = (encoded + lagged + dropped).max(1) as f64;
+        Some(BpmRates {
+            encoded,
+            lagged,
+            dropped,
+            fps: encoded as f64 * 1000.0 / elapsed_ms as f64,
+            lagged_ratio: lagged as f64 / input,
+            dropped_ratio: dropped as f64 / input,
+            window_ms: elapsed_ms.min(u32::MAX as u64) as u32,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::cell::Cell;
+    use std::sync::Arc;
+    use std::thread;
+
+    const START_MS: u64 = 1000 * BUCKET_MS;   // Start of bucket 1000
+
+    // Track counting one encoded frame every frame_ms, ticking before each count like the frame calls
+    struct Encoder {
+        rates: TrackRates,
+        encoded: Cell<u64>,
+        lagged: Cell<u64>,
+    }
+
+    impl Encoder {
+        fn new() -> Encoder {
+            Encoder { rates: TrackRates::new(), encoded: Cell::new(0), lagged: Cell::new(0) }
+        }
+
+        fn counts(&self) -> [u64; 3] {
+            [self.encoded.get(), self.lagged.get(), 0]
+        }
+
+        // Frames at from_ms, from_ms + frame_ms, ... before until_ms
+        fn run(&self, from_ms: u64, until_ms: u64, frame_ms: u64) {
+            let mut now_ms = from_ms;
+            while now_ms < until_ms {
+                self.rates.tick_at(now_ms, || self.counts());
+                self.encoded.set(self.encoded.get() + 1);
+                now_ms += frame_ms;
+            }
+        }
+
+        fn query(&self, window: u32, now_ms: u64) -> BpmRates {
+            self.rates.query_at(window, now_ms, || self.counts()).unwrap()
+        }
+    }
+
+    #[test]
+    fn no_frames() {
+        let encoder = Encoder::new();
+        assert!(encoder.rates.query_at(3, START_MS, || encoder.counts()).is_none());
+        // The first query starts the history of the track
+        let rates = encoder.query(BPM_RATE_WINDOW_1S, START_MS + 10);
+        assert_eq!((rates.encoded, rates.fps, rates.window_ms), (0, 0.0, 10));
+    }
+
+    #[test]
+    fn steady_rate() {
+        let encoder = Encoder::new();
+        encoder.run(START_MS, START_MS + 10_000, 25);
+        let rates = encoder.query(BPM_RATE_WINDOW_1S, START_MS + 10_000);
+        assert_eq!((rates.encoded, rates.window_ms, rates.fps), (40, 1000, 40.0));
+        let rates = encoder.query(BPM_RATE_WINDOW_5S, START_MS + 10_000);
+        assert_eq!((rates.encoded, rates.window_ms, rates.fps), (200, 5000, 40.0));
+    }
+
+    #[test]
+    fn window_edges() {
+        let encoder = Encoder::new();
+        encoder.run(START_MS, START_MS + 10_100, 25);
+        // The window starts at the bucket boundary before now - window, so it covers up to one bucket more
+        let rates = encoder.query(BPM_RATE_WINDOW_1S, START_MS + 10_100);
+        assert_eq!((rates.encoded, rates.window_ms, rates.fps), (44, 1100, 40.0));
+        let rates = encoder.query(BPM_RATE_WINDOW_1S, START_MS + 10_249);
+        assert_eq!(rates.window_ms, 1249);
+        // A track younger than the window covers its lifetime only
+        let rates = encoder.query(BPM_RATE_WINDOW_30S, START_MS + 10_100);
+        assert_eq!((rates.encoded, rates.window_ms, rates.fps), (404, 10_100, 40.0));
+    }
+
+    #[test]
+    fn slots_reused_after_wrap() {
+        let encoder = Encoder::new();
+        let end_ms = START_MS + 4 * BUCKETS as u64 * BUCKET_MS;
+        encoder.run(START_MS, end_ms, 20);
+        let windows = [(BPM_RATE_WINDOW_1S, 1000), (BPM_RATE_WINDOW_5S, 5000), (BPM_RATE_WINDOW_30S, 30_000)];
+        for (window, window_ms) in windows.iter() {
+            let rates = encoder.query(*window, end_ms);
+            assert_eq!((rates.encoded, rates.window_ms, rates.fps), (window_ms / 20, *window_ms as u32, 50.0));
+        }
+    }
+
+    #[test]
+    fn idle_longer_than_ring() {
+        let encoder = Encoder::new();
+        encoder.run(START_MS, START_MS + 10_000, 25);
+        let resumed_ms = START_MS + 100_000;
+        // No frames in the window: the skipped slots hold the counts of the last frame
+        for window in [BPM_RATE_WINDOW_1S, BPM_RATE_WINDOW_5S, BPM_RATE_WINDOW_30S].iter() {
+            let rates = encoder.query(*window, resumed_ms);
+            assert_eq!((rates.encoded, rates.fps), (0, 0.0), "window {}", window);
+        }
+        encoder.run(resumed_ms, resumed_ms + 2000, 25);
+        let rates = encoder.query(BPM_RATE_WINDOW_5S, resumed_ms + 2000);
+        assert_eq!((rates.encoded, rates.window_ms, rates.fps), (80, 5000, 16.0));
+        let rates = encoder.query(BPM_RATE_WINDOW_30S, resumed_ms + 2000);
+        assert_eq!(rates.encoded, 80);
+    }
+
+    #[test]
+    fn lagged_ratio() {
+        let encoder = Encoder::new();
+        encoder.run(START_MS, START_MS + 5000, 25);
+        encoder.lagged.set(50);
+        let rates = encoder.query(BPM_RATE_WINDOW_5S, START_MS + 5000);
+        assert_eq!((rates.encoded, rates.lagged, rates.lagged_ratio), (200, 50, 0.2));
+    }
+
+    #[test]
+    fn counts_read_by_the_bucket_starter_only() {
+        let rates = TrackRates::new();
+        rates.tick_at(START_MS, || [1, 0, 0]);
+        rates.tick_at(START_MS + 1, || panic!("counts read in a started bucket"));
+        rates.tick_at(START_MS - BUCKET_MS, || panic!("counts read for an earlier bucket"));
+        rates.tick_at(START_MS + BUCKET_MS, || [2, 0, 0]);
+        assert_eq!(rates.slots[1001 % BUCKETS].load(1001), Some([2, 0, 0]));
+        assert_eq!(rates.slots[1000 % BUCKETS].load(1000), Some([1, 0, 0]));
+        assert_eq!(rates.slots[1000 % BUCKETS].load(1000 + BUCKETS as u64), None);
+    }
+
+    #[test]
+    fn slot_read_while_written() {
+        let slot = Arc::new(Slot::new());
+        slot.store(7, &[0; 3]);
+        let writer = slot.clone();
+        let thread = thread::spawn(move || {
+            for n in 1..=100_000 {
+                writer.store(7, &[n, n, n]);
+            }
+        });
+        let mut last = 0;
+        while last < 100_000 {
+            let [a, b, c] = slot.load(7).unwrap();
+            assert!(a == b && b == c && a >= last, "torn read {:?} after {}", [a, b, c], last);
+            last = a;
+        }
+        thread.join().unwrap();
+    }
+}
@@ -0,0 +1,306 @@
+//! Binary log of the frame, mark and render calls of a session, for replaying production
+//! load against the library offline.
+//!
+//! Calls append fixed-size records to a buffer that a background thread writes to the file
+//! every WRITE_INTERVAL, so the encoder threads never wait on the disk. Renders are logged
+//! with the time they rendered with, so a replay of the log produces the same payloads.
+//!
+//! File: 8-byte magic, u32 version, u32 record size, then the records, little endian.
+
+use parking_lot::Mutex;
+use std::convert::TryInto;
+use std::fs::File;
+use std::io::{self, BufReader, Read, Write};
+use std::mem;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use std::time::Duration;
+
+use crate::clock;
+use crate::session::BPM_EVENT_BYTES_DROPPED;
+use crate::tracks::MAX_TRACKS;
+use crate::{BPM_TS_EVENT_CTS, BPM_TS_EVENT_PIR, TS_TYPE_DURATION, TS_TYPE_RFC3339};
+
+pub const BPM_RECORD_FRAMES: u16 = 1;    // event: BPM_EVENT_*, values[0]: count
+pub const BPM_RECORD_MARK: u16 = 2;      // event: BPM_TS_EVENT_*, values: frame id, UTC micros
+pub const BPM_RECORD_TS: u16 = 3;        // event: timestamp type, values: CTS, FER, FERC, PIR in UTC millis
+pub const BPM_RECORD_SM: u16 = 4;        // event: timestamp type, values: now in UTC millis, 1 if rendered against the totals of an epoch
+pub const BPM_RECORD_ERM: u16 = 5;       // event: timestamp type, values[0]: now in UTC millis
+pub const BPM_RECORD_TRACK: u16 = 6;     // Track registered, or in use when the recording started
+pub const BPM_RECORD_EPOCH: u16 = 7;     // Session counters read by bpm_begin_epoch, values[0]: pts
+
+/// Track of the TS renders that take no track, e.g. bpm_render_ts_into64
+pub const BPM_RECORD_NO_TRACK: u32 = u32::MAX;
+
+const MAGIC: [u8; 8] = *b"BPMREC\0\0";
+const VERSION: u32 = 1;
+const RECORD_SIZE: usize = 48;
+const WRITE_INTERVAL: Duration = Duration::from_millis(10);
+
+#[derive(Clone, Copy, Default)]
+pub struct Record {
+    pub time_us: i64,       // Since the recording started, on the monotonic clock
+    pub op: u16,            // BPM_RECORD_*
+    pub event: u16,
+    pub track_idx: u32,
+    pub values: [i64; 4],
+}
+
+impl Record {
+    pub fn new(op: u16, event: u16, track_idx: u32, values: [i64; 4]) -> Record {
+        Record { time_us: 0, op, event, track_idx, values }
+    }
+
+    fn encode(&self, out: &mut Vec<u8>) {
+        out.extend_from_slice(&self.time_us.to_le_bytes());
+        out.extend_from_slice(&self.op.to_le_bytes());
+        out.extend_from_slice(&self.event.to_le_bytes());
+        out.extend_from_slice(&self.track_idx.to_le_bytes());
+        for value in &self.values {
+            out.extend_from_slice(&value.to_le_bytes());
+        }
+    }
+
+    /// Known op, with an event in the range of the op and a track index within the track table
+    fn is_valid(&self) -> bool {
+        let event = self.event;
+        let valid_event = match self.op {
+            BPM_RECORD_FRAMES => event as u32 <= BPM_EVENT_BYTES_DROPPED,
+            BPM_RECORD_MARK => (BPM_TS_EVENT_CTS as u16..=BPM_TS_EVENT_PIR as u16).contains(&event),
+            BPM_RECORD_TS | BPM_RECORD_SM | BPM_RECORD_ERM => {
+                (TS_TYPE_RFC3339 as u16..=TS_TYPE_DURATION as u16).contains(&event)
+            },
+            BPM_RECORD_TRACK | BPM_RECORD_EPOCH => event == 0,
+            _ => false,
+        };
+        let session_wide = self.op == BPM_RECORD_TS && self.track_idx == BPM_RECORD_NO_TRACK;
+        valid_event && ((self.track_idx as usize) < MAX_TRACKS || session_wide)
+    }
+
+    fn decode(data: &[u8; RECORD_SIZE]) -> Record {
+        let i64_at = |offset: usize| i64::from_le_bytes(data[offset..offset + 8].try_into().unwrap());
+        Record {
+            time_us: i64_at(0),
+            op: u16::from_le_bytes([data[8], data[9]]),
+            event: u16::from_le_bytes([data[10], data[11]]),
+            track_idx: u32::from_le_bytes(data[12..16].try_into().unwrap()),
+            values: [i64_at(16), i64_at(24), i64_at(32), i64_at(40)],
+        }
+    }
+}
+
+struct Shared {
+    pending: Mutex<Vec<u8>>,
+    start_ns: i64,
+    stop: AtomicBool,
+}
+
+/// Running recording, written out and closed on drop
+pub struct Recorder {
+    shared: Arc<Shared>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl Recorder {
+    /// Start logging to a new file at path, replacing an existing one
+    pub fn start(path: &str) -> Option<Recorder> {
+        let mut file = File::create(path).ok()?;
+        file.write_all(&MAGIC).ok()?;
+        file.write_all(&VERSION.to_le_bytes()).ok()?;
+        file.write_all(&(RECORD_SIZE as u32).to_le_bytes()).ok()?;
+
+        let shared = Arc::new(Shared {
+            pending: Mutex::new(Vec::with_capacity(64 * 1024)),
+            start_ns: clock::monotonic_ns(),
+            stop: AtomicBool::new(false),
+        });
+        let writer = shared.clone();
+        let thread = thread::Builder::new()
+            .name("bpm-record".to_string())
+            .spawn(move || run(&writer, file))
+            .ok()?;
+        Some(Recorder { shared, thread: Some(thread) })
+    }
+
+    pub fn push(&self, record: Record) {
+        self.push_with(record, || ());
+    }
+
+    /// Log a record together with a counter update or read, under the lock of the log, so records
+    /// from other threads are ordered with the counters they changed or read
+    pub fn push_with<R>(&self, mut record: Record, counters: impl FnOnce() -> R) -> R {
+        let mut pending = self.shared.pending.lock();
+        let result = counters();
+        record.time_us = (clock::monotonic_ns() - self.shared.start_ns) / 1000;
+        record.encode(&mut pending);
+        result
+    }
+}
+
+impl Drop for Recorder {
+    fn drop(&mut self) {
+        self.shared.stop.store(true, Ordering::Relaxed);
+        if let Some(thread) = self.thread.take() {
+            thread.thread().unpark();
+            let _ = thread.join();
+        }
+    }
+}
+
+fn run(shared: &Shared, mut file: File) {
+    let mut buffer = Vec::with_capacity(64 * 1024);
+    loop {
+        let stop = shared.stop.load(Ordering::Relaxed);
+
+        mem::swap(&mut buffer, &mut shared.pending.lock());
+        // The log is best effort, records that cannot be written are lost
+        let _ = file.write_all(&buffer);
+        buffer.clear();
+
+        if stop {
+            let _ = file.flush();
+            return;
+        }
+        thread::park_timeout(WRITE_INTERVAL);
+    }
+}
+
+/// Records of a log, in the order they were written. Fails on a truncated record or one
+/// that is not valid, so a corrupt log is never fed to a session.
+pub fn read(path: &str) -> io::Result<Vec<Record>> {
+    let invalid = |what| io::Error::new(io::ErrorKind::InvalidData, what);
+    let mut reader = BufReader::new(File::open(path)?);
+    let mut header = [0u8; 16];
+    reader.read_exact(&mut header)?;
+    if header[..8] != MAGIC || header[8..12] != VERSION.to_le_bytes() || header[12..16] != (RECORD_SIZE as u32).to_le_bytes() {
+        return Err(invalid("not a bpm record log"));
+    }
+
+    let mut data = Vec::new();
+    reader.read_to_end(&mut data)?;
+    let chunks = data.chunks_exact(RECORD_SIZE);
+    if !chunks.remainder().is_empty() {
+        return Err(invalid("truncated bpm record"));
+    }
+    chunks.map(|chunk| {
+        let record = Record::decode(chunk.try_into().unwrap());
+        if record.is_valid() { Ok(record) } else { Err(invalid("invalid bpm record")) }
+    }).collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::ffi::{c_void, CString};
+    use std::ptr;
+
+    use crate::session::{Session, BPM_EVENT_ENCODED};
+
+    // Log with the given records and extra bytes, in a file named after the test
+    fn write_log(name: &str, records: &[Record], extra: &[u8]) -> String {
+        let path = std::env::temp_dir().join(format!("bpm-{}-{}.bpmrec", name, std::process::id()));
+        let mut data = Vec::new();
+        data.extend_from_slice(&MAGIC);
+        data.extend_from_slice(&VERSION.to_le_bytes());
+        data.extend_from_slice(&(RECORD_SIZE as u32).to_le_bytes());
+        for record in records {
+            record.encode(&mut data);
+        }
+        data.extend_from_slice(extra);
+        std::fs::write(&path, data).unwrap();
+        path.to_str().unwrap().to_string()
+    }
+
+    fn replay(path: &str) -> i64 {
+        let session = Session::new();
+        let path = CString::new(path).unwrap();
+        crate::bpm_session_replay(&session as *const Session as *mut Session, path.as_ptr(), None, ptr::null_mut())
+    }
+
+    fn frames(track_idx: u32) -> Record {
+        Record::new(BPM_RECORD_FRAMES, BPM_EVENT_ENCODED as u16, track_idx, [1, 0, 0, 0])
+    }
+
+    #[test]
+    fn valid_log() {
+        let records = [
+            Record::new(BPM_RECORD_TRACK, 0, 0, [0; 4]),
+            frames(0),
+            Record::new(BPM_RECORD_MARK, BPM_TS_EVENT_PIR as u16, 0, [7, 1_000_000, 0, 0]),
+            Record::new(BPM_RECORD_SM, TS_TYPE_RFC3339 as u16, 0, [1000, 0, 0, 0]),
+            Record::new(BPM_RECORD_ERM, TS_TYPE_DURATION as u16, 0, [1000, 0, 0, 0]),
+        ];
+        let path = write_log("valid", &records, &[]);
+        assert_eq!(read(&path).unwrap().len(), records.len());
+        assert_eq!(replay(&path), records.len() as i64);
+        std::fs::remove_file(path).unwrap();
+    }
+
+    extern "C" fn collect_tracks(user: *mut c_void, op: u32, track_idx: u32, _data: *const u8, _size: u32) {
+        let tracks = unsafe { &mut *(user as *mut Vec<(u32, u32)>) };
+        tracks.push((op, track_idx));
+    }
+
+    #[test]
+    fn replayed_tracks() {
+        let records = [
+            Record::new(BPM_RECORD_TS, TS_TYPE_RFC3339 as u16, 2, [1, 2, 3, 4]),
+            Record::new(BPM_RECORD_TS, TS_TYPE_RFC3339 as u16, BPM_RECORD_NO_TRACK, [1, 2, 3, 4]),
+            Record::new(BPM_RECORD_ERM, TS_TYPE_RFC3339 as u16, 3, [1000, 0, 0, 0]),
+        ];
+        let path = write_log("tracks", &records, &[]);
+        let session = Session::new();
+        let mut tracks: Vec<(u32, u32)> = Vec::new();
+        let c_path = CString::new(path.as_str()).unwrap();
+        let replayed = crate::bpm_session_replay(&session as *const Session as *mut Session, c_path.as_ptr(),
+                                                 Some(collect_tracks), &mut tracks as *mut Vec<(u32, u32)> as *mut c_void);
+        assert_eq!(replayed, 3);
+        let (ts, erm) = (BPM_RECORD_TS as u32, BPM_RECORD_ERM as u32);
+        assert_eq!(tracks, [(ts, 2), (ts, BPM_RECORD_NO_TRACK), (erm, 3)]);
+        std::fs::remove_file(path).unwrap();
+    }
+
+    #[test]
+    fn truncated_log() {
+        let mut partial = Vec::new();
+        frames(0).encode(&mut partial);
+        partial.truncate(RECORD_SIZE - 1);
+        let path = write_log("truncated", &[frames(0)], &partial);
+        assert!(read(&path).is_err());
+        assert_eq!(replay(&path), -1);
+        std::fs::remove_file(path).unwrap();
+    }
+
+    #[test]
+    fn corrupted_records() {
+        let corrupted = [
+            Record::new(BPM_RECORD_MARK, 0, 0, [1, 1, 0, 0]),
+            Record::new(BPM_RECORD_MARK, BPM_TS_EVENT_PIR as u16 + 1, 0, [1, 1, 0, 0]),
+            Record::new(BPM_RECORD_FRAMES, BPM_EVENT_BYTES_DROPPED as u16 + 1, 0, [1, 0, 0, 0]),
+            Record::new(BPM_RECORD_SM, 0, 0, [1000, 0, 0, 0]),
+            Record::new(BPM_RECORD_TS, 3, 0, [1, 2, 3, 4]),
+            Record::new(BPM_RECORD_TRACK, 1, 0, [0; 4]),
+            Record::new(0, 0, 0, [0; 4]),
+            Record::new(BPM_RECORD_EPOCH + 1, 0, 0, [0; 4]),
+            frames(MAX_TRACKS as u32),
+            Record::new(BPM_RECORD_SM, TS_TYPE_RFC3339 as u16, BPM_RECORD_NO_TRACK, [1000, 0, 0, 0]),
+            frames(u32::MAX),
+        ];
+        for (i, record) in corrupted.iter().enumerate() {
+            // The valid records before a corrupted one are not replayed either
+            let path = write_log(&format!("corrupted-{}", i), &[frames(0), *record, frames(0)], &[]);
+            assert!(read(&path).is_err(), "record {}", i);
+            assert_eq!(replay(&path), -1, "record {}", i);
+            std::fs::remove_file(path).unwrap();
+        }
+    }
+
+    #[test]
+    fn not_a_log() {
+        let path = std::env::temp_dir().join(format!("bpm-not-a-log-{}.bpmrec", std::process::id()));
+        std::fs::write(&path, b"BPMREC").unwrap();
+        assert_eq!(replay(path.to_str().unwrap()), -1);
+        std::fs::remove_file(path).unwrap();
+    }
+}
@@ -0,0 +1,173 @@
+//! Allocation-free RFC 3339 formatting of UTC milliseconds, e.g. 2025-01-31T12:34:56.789Z
+
+use std::cell::Cell;
+
+/// Formatted size: YYYY-MM-DDTHH:MM:SS.mmmZ
+pub const RFC3339_SIZE: usize = 24;
+
+const PREFIX_SIZE: usize = 19;          // YYYY-MM-DDTHH:MM:SS
+const SECS_PER_DAY: i64 = 86_400;
+const MIN_MILLIS: i64 = -62_167_219_200_000;    // 0000-01-01T00:00:00.000Z
+const MAX_MILLIS: i64 = 253_402_300_799_999;    // 9999-12-31T23:59:59.999Z
+
+thread_local! {
+    // Unix second of the cached prefix and the prefix itself.
+    // Date is recomputed only on day rollover, time of day on second rollover.
+    static PREFIX: Cell<(i64, [u8; PREFIX_SIZE])> = Cell::new((i64::MIN, [0; PREFIX_SIZE]));
+}
+
+/// Write milliseconds since the Unix epoch in RFC 3339 format.
+/// Timestamps outside years 0000-9999 are clamped to keep the fixed size.
+pub fn write_rfc3339(out: &mut [u8; RFC3339_SIZE], timestamp_ms: i64) {
+    let timestamp_ms = timestamp_ms.clamp(MIN_MILLIS, MAX_MILLIS);
+    let secs = timestamp_ms.div_euclid(1000);
+    let millis = timestamp_ms.rem_euclid(1000) as u32;
+
+    let (cached_secs, mut prefix) = PREFIX.with(|p| p.get());
+    if secs != cached_secs {
+        let day = secs.div_euclid(SECS_PER_DAY);
+        if day != cached_secs.div_euclid(SECS_PER_DAY) {
+            write_date(&mut prefix, day);
+        }
+        write_time_of_day(&mut prefix, secs.rem_euclid(SECS_PER_DAY) as u32);
+        PREFIX.with(|p| p.set((secs, prefix)));
+    }
+
+    out[0..PREFIX_SIZE].copy_from_slice(&prefix);
+    out[19] = b'.';
+    write_digits(&mut out[20..23], millis);
+    out[23] = b'Z';
+}
+
+/// YYYY-MM-DDT from days since the Unix epoch (proleptic Gregorian calendar)
+fn write_date(prefix: &mut [u8; PREFIX_SIZE], days: i64) {
+    let z = days + 719_468;
+    let era = z.div_euclid(146_097);
+    let doe = z.rem_euclid(146_097);                                    // Day of era [0, 146096]
+    let yoe = (doe - doe / 1460 + doe / 36_524 - doe / 146_096) / 365;  // Year of era [0, 399]
+    let doy = doe - (365 * yoe + yoe / 4 - yoe / 100);                  // Day of year from March 1st [0, 365]
+    let mp = (5 * doy + 2) / 153;                                       // Month from March [0, 11]
+    let day = doy - (153 * mp + 2) / 5 + 1;
+    let month = if mp < 10 { mp + 3 } else { mp - 9 };
+    let year = yoe + era * 400 + if month <= 2 { 1 } else { 0 };
+
+    write_digits(&mut prefix[0..4], year as u32);
+    prefix[4] = b'-';
+    write_digits(&mut prefix[5..7], month as u32);
+    prefix[7] = b'-';
+    write_digits(&mut prefix[8..10], day as u32);
+    prefix[10] = b'T';
+}
+
+/// HH:MM:SS from seconds since midnight
+fn write_time_of_day(prefix: &mut [u8; PREFIX_SIZE], secs: u32) {
+    write_digits(&mut prefix[11..13], secs / 3600);
+    prefix[13] = b':';
+    write_digits(&mut prefix[14..16], secs / 60 % 60);
+    prefix[16] = b':';
+    write_digits(&mut prefix[17..19], secs % 60);
+}
+
+/// Zero-padded decimal digits filling the whole slice
+fn write_digits(out: &mut [u8], mut value: u32) {
+    for digit in out.iter_mut().rev() {
+        *digit = b'0' + (value % 10) as u8;
+        value /= 10;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use chrono::{SecondsFormat, TimeZone, Utc};
+
+    fn format(timestamp_ms: i64) -> String {
+        let mut out = [0; RFC3339_SIZE];
+        write_rfc3339(&mut out, timestamp_ms);
+        String::from_utf8(out.to_vec()).unwrap()
+    }
+
+    fn expected(timestamp_ms: i64) -> String {
+        Utc.timestamp_millis_opt(timestamp_ms).unwrap().to_rfc3339_opts(SecondsFormat::Millis, true)
+    }
+
+    fn assert_chrono(timestamp_ms: i64) {
+        assert_eq!(format(timestamp_ms), expected(timestamp_ms), "timestamp {}", timestamp_ms);
+    }
+
+    #[test]
+    fn days_around_leap_years() {
+        // 1899-03-01 to 2101-03-01, every day at a different time of day
+        let first = Utc.with_ymd_and_hms(1899, 3, 1, 0, 0, 0).unwrap().timestamp_millis();
+        for day in 0..(202 * 366) {
+            let midnight = first + day * SECS_PER_DAY * 1000;
+            assert_chrono(midnight);
+            assert_chrono(midnight + day * 7919 % (SECS_PER_DAY * 1000));
+            assert_chrono(midnight - 1);
+        }
+    }
+
+    #[test]
+    fn leap_days_and_year_rollovers() {
+        for &(year, month, day) in [(2000, 2, 29), (2024, 2, 29), (1900, 3, 1), (2100, 3, 1), (1600, 2, 29), (4, 2, 29)].iter() {
+            let midnight = Utc.with_ymd_and_hms(year, month, day, 0, 0, 0).unwrap().timestamp_millis();
+            assert_chrono(midnight - 1);
+            assert_chrono(midnight);
+            assert_chrono(midnight + SECS_PER_DAY * 1000 - 1);
+        }
+        for year in [1, 1969, 1970, 1999, 2000, 2038, 9999].iter() {
+            let new_year = Utc.with_ymd_and_hms(*year, 1, 1, 0, 0, 0).unwrap().timestamp_millis();
+            assert_chrono(new_year - 1);
+            assert_chrono(new_year);
+        }
+    }
+
+    #[test]
+    fn whole_range() {
+        let mut timestamp_ms = MIN_MILLIS;
+        while timestamp_ms <= MAX_MILLIS {
+            assert_chrono(timestamp_ms);
+            timestamp_ms += 1_000_003_333;
+        }
+        assert_chrono(MIN_MILLIS);
+        assert_chrono(MAX_MILLIS);
+    }
+
+    #[test]
+    fn negative() {
+        assert_eq!(format(-1), "1969-12-31T23:59:59.999Z");
+        assert_eq!(format(-1000), "1969-12-31T23:59:59.000Z");
+        assert_eq!(format(-1001), "1969-12-31T23:59:58.999Z");
+        for timestamp_ms in (-100_000..0).step_by(997) {
+            assert_chrono(timestamp_ms);
+        }
+    }
+
+    #[test]
+    fn clamped() {
+        for timestamp_ms in [i64::MIN, MIN_MILLIS - 1, -100_000_000_000_000_000].iter() {
+            assert_eq!(format(*timestamp_ms), "0000-01-01T00:00:00.000Z");
+        }
+        for timestamp_ms in [i64::MAX, MAX_MILLIS + 1, 100_000_000_000_000_000].iter() {
+            assert_eq!(format(*timestamp_ms), "9999-12-31T23:59:59.999Z");
+        }
+    }
+
+    #[test]
+    fn cached_prefix() {
+        let start = Utc.with_ymd_and_hms(2025, 1, 31, 23, 59, 58).unwrap().timestamp_millis();
+        // Same second, next second, next day and back, as consecutive renders would format them
+        for timestamp_ms in start..start + 4000 {
+            assert_chrono(timestamp_ms);
+        }
+        for &timestamp_ms in [start + 4000, start, start, start + SECS_PER_DAY * 1000, start, start - 1].iter() {
+            assert_chrono(timestamp_ms);
+        }
+        // Same time of day on another day, which keeps the time but not the date of the cache
+        assert_chrono(start + SECS_PER_DAY * 1000 * 365);
+        assert_chrono(start);
+        // Clamped after a cached prefix of another day
+        assert_eq!(format(i64::MAX), "9999-12-31T23:59:59.999Z");
+        assert_chrono(start);
+    }
+}
@@ -0,0 +1,337 @@
+//! Wrapping of BPM payloads into SEI NAL units (AVC/HEVC) and metadata OBUs (AV1)
+
+pub const BPM_CODEC_AVC: i32 = 0;
+pub const BPM_CODEC_HEVC: i32 = 1;
+pub const BPM_CODEC_AV1: i32 = 2;
+
+pub const BPM_FRAMING_ANNEXB: i32 = 0;      // 4-byte start code
+pub const BPM_FRAMING_LENGTH: i32 = 1;      // 4-byte big-endian length prefix
+
+const START_CODE: [u8; 4] = [0x00, 0x00, 0x00, 0x01];
+const AVC_NAL_SEI: [u8; 1] = [0x06];                // nal_ref_idc 0, nal_unit_type 6
+const HEVC_NAL_PREFIX_SEI: [u8; 2] = [0x4e, 0x01];  // nal_unit_type 39, nuh_layer_id 0, nuh_temporal_id_plus1 1
+const SEI_USER_DATA_UNREGISTERED: u8 = 5;
+const RBSP_TRAILING_BITS: u8 = 0x80;
+
+const OBU_METADATA_HEADER: u8 = 0x2a;               // obu_type 5 (OBU_METADATA), obu_has_size_field 1
+const METADATA_TYPE_USER_PRIVATE_6: u8 = 6;         // Metadata type used for BPM in AV1
+const TRAILING_BITS: u8 = 0x80;
+
+/// Bounded writer into a caller buffer. Keeps counting past the capacity,
+/// so the required size is known when the buffer is too small.
+pub struct Writer<'a> {
+    buf: &'a mut [u8],
+    pos: usize,
+}
+
+impl<'a> Writer<'a> {
+    pub fn new(buf: &'a mut [u8]) -> Writer<'a> {
+        Writer { buf, pos: 0 }
+    }
+
+    pub fn len(&self) -> usize {
+        self.pos
+    }
+
+    /// All written data fit into the buffer
+    pub fn fits(&self) -> bool {
+        self.pos <= self.buf.len()
+    }
+
+    fn put(&mut self, data: &[u8]) {
+        let end = self.pos + data.len();
+        if end <= self.buf.len() {
+            self.buf[self.pos..end].copy_from_slice(data);
+        }
+        self.pos = end;
+    }
+
+    fn put_u8(&mut self, value: u8) {
+        if self.pos < self.buf.len() {
+            self.buf[self.pos] = value;
+        }
+        self.pos += 1;
+    }
+
+    fn patch_be32(&mut self, pos: usize, value: u32) {
+        if pos + 4 <= self.buf.len() {
+            self.buf[pos..pos + 4].copy_from_slice(&value.to_be_bytes());
+        }
+    }
+}
+
+/// Write the BPM payloads as user_data_unregistered SEI messages of one SEI NAL unit,
+/// or as one metadata OBU per payload for AV1. Returns false for an unknown codec or framing.
+pub fn write_payloads(out: &mut Writer, codec: i32, framing: i32, payloads: &[&[u8]]) -> bool {
+    let header: &[u8] = match codec {
+        BPM_CODEC_AVC => &AVC_NAL_SEI,
+        BPM_CODEC_HEVC => &HEVC_NAL_PREFIX_SEI,
+        BPM_CODEC_AV1 => {
+            for payload in payloads {
+                write_metadata_obu(out, payload);
+            }
+            return true;
+        },
+        _ => return false,
+    };
+
+    let length_pos = out.len();
+    match framing {
+        BPM_FRAMING_ANNEXB => out.put(&START_CODE),
+        BPM_FRAMING_LENGTH => out.put(&[0; 4]),
+        _ => return false,
+    }
+
+    let nal_start = out.len();
+    out.put(header);
+    let mut zeros = 0;
+    for payload in payloads {
+        let mut message = [0; 2 * 4];
+        let mut message_len = 0;
+        for value in [SEI_USER_DATA_UNREGISTERED as usize, payload.len()].iter() {
+            message_len += sei_value(&mut message[message_len..], *value);
+        }
+        write_emulation_prevented(out, &message[..message_len], &mut zeros);
+        write_emulation_prevented(out, payload, &mut zeros);
+    }
+    out.put_u8(RBSP_TRAILING_BITS);
+
+    if framing == BPM_FRAMING_LENGTH {
+        let nal_size = out.len() - nal_start;
+        out.patch_be32(length_pos, nal_size as u32);
+    }
+    return true;
+}
+
+/// Largest output of write_payloads for payloads of the given sizes, counting an
+/// emulation_prevention_three_byte for every two RBSP bytes. None for an unknown codec or framing.
+pub fn max_size(codec: i32, framing: i32, payload_sizes: &[usize]) -> Option<usize> {
+    let header = match codec {
+        BPM_CODEC_AVC => AVC_NAL_SEI.len(),
+        BPM_CODEC_HEVC => HEVC_NAL_PREFIX_SEI.len(),
+        BPM_CODEC_AV1 => {
+            return Some(payload_sizes.iter().map(|size| 1 + leb128_size(size + 2) + size + 2).sum());
+        },
+        _ => return None,
+    };
+    if framing != BPM_FRAMING_ANNEXB && framing != BPM_FRAMING_LENGTH {
+        return None;
+    }
+
+    let rbsp: usize = payload_sizes.iter()
+        .map(|size| sei_value_size(SEI_USER_DATA_UNREGISTERED as usize) + sei_value_size(*size) + size)
+        .sum();
+    Some(START_CODE.len() + header + rbsp + rbsp / 2 + 1)
+}
+
+fn sei_value_size(value: usize) -> usize {
+    value / 255 + 1
+}
+
+fn leb128_size(value: usize) -> usize {
+    let bits = (usize::BITS - value.leading_zeros()) as usize;
+    (bits.max(1) + 6) / 7
+}
+
+/// SEI payloadType / payloadSize coding: 0xFF for every full 255, then the remainder
+fn sei_value(out: &mut [u8], mut value: usize) -> usize {
+    let mut len = 0;
+    while value >= 255 {
+        out[len] = 0xff;
+        value -= 255;
+        len += 1;
+    }
+    out[len] = value as u8;
+    return len + 1;
+}
+
+/// AV1 metadata OBU carrying one BPM payload
+fn write_metadata_obu(out: &mut Writer, payload: &[u8]) {
+    out.put_u8(OBU_METADATA_HEADER);
+    write_leb128(out, 1 + payload.len() + 1);  // metadata_type, payload, trailing bits
+    out.put_u8(METADATA_TYPE_USER_PRIVATE_6);
+    out.put(payload);
+    out.put_u8(TRAILING_BITS);
+}
+
+fn write_leb128(out: &mut Writer, mut value: usize) {
+    loop {
+        let byte = (value & 0x7f) as u8;
+        value >>= 7;
+        if value == 0 {
+            out.put_u8(byte);
+            return;
+        }
+        out.put_u8(byte | 0x80);
+    }
+}
+
+/// Copy RBSP data inserting emulation_prevention_three_byte after every two zero bytes
+/// followed by a byte <= 0x03. Runs of non-zero bytes are copied in bulk between zero bytes.
+/// The count of preceding zero bytes is carried over between calls for the same NAL unit.
+fn write_emulation_prevented(out: &mut Writer, rbsp: &[u8], zeros: &mut usize) {
+    let mut i = 0;
+    while i < rbsp.len() {
+        if *zeros == 0 {
+            let next = find_zero(&rbsp[i..]).map_or(rbsp.len(), |pos| i + pos);
+            out.put(&rbsp[i..next]);
+            i = next;
+            if i == rbsp.len() {
+                break;
+            }
+        }
+
+        let byte = rbsp[i];
+        if *zeros == 2 && byte <= 0x03 {
+            out.put_u8(0x03);
+            *zeros = 0;
+        }
+        out.put_u8(byte);
+        *zeros = if byte == 0 { *zeros + 1 } else { 0 };
+        i += 1;
+    }
+}
+
+/// Position of the first zero byte, testing eight bytes per step with word-wide (SWAR) arithmetic
+fn find_zero(data: &[u8]) -> Option<usize> {
+    const LO: u64 = 0x0101_0101_0101_0101;
+    const HI: u64 = 0x8080_8080_8080_8080;
+
+    let mut chunks = data.chunks_exact(8);
+    let mut offset = 0;
+    for chunk in &mut chunks {
+        let mut word = [0; 8];
+        word.copy_from_slice(chunk);
+        let word = u64::from_le_bytes(word);
+        if word.wrapping_sub(LO) & !word & HI != 0 {
+            break;
+        }
+        offset += 8;
+    }
+    data[offset..].iter().position(|&b| b == 0).map(|pos| offset + pos)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn emulation_prevented(rbsp: &[u8]) -> Vec<u8> {
+        let mut buf = vec![0; rbsp.len() * 2];
+        let mut out = Writer::new(&mut buf);
+        write_emulation_prevented(&mut out, rbsp, &mut 0);
+        let len = out.len();
+        buf.truncate(len);
+        buf
+    }
+
+    // Byte at a time, as the spec describes it
+    fn reference(rbsp: &[u8]) -> Vec<u8> {
+        let mut out = Vec::new();
+        let mut zeros = 0;
+        for &byte in rbsp {
+            if zeros == 2 && byte <= 0x03 {
+                out.push(0x03);
+                zeros = 0;
+            }
+            out.push(byte);
+            zeros = if byte == 0 { zeros + 1 } else { 0 };
+        }
+        out
+    }
+
+    #[test]
+    fn find_zero_positions() {
+        assert_eq!(find_zero(&[]), None);
+        assert_eq!(find_zero(&[0xff; 24]), None);
+        assert_eq!(find_zero(&[0x80; 7]), None);
+        for len in 1..=24 {
+            for pos in 0..len {
+                let mut data = vec![0x01; len];
+                data[pos] = 0;
+                assert_eq!(find_zero(&data), Some(pos), "len {} pos {}", len, pos);
+                // Neither zeros after it nor high bits before it move the first zero
+                for byte in data[pos + 1..].iter_mut() {
+                    *byte = 0;
+                }
+                assert_eq!(find_zero(&data), Some(pos), "len {} pos {} zero tail", len, pos);
+                for byte in data[..pos].iter_mut() {
+                    *byte = 0x80;
+                }
+                assert_eq!(find_zero(&data), Some(pos), "len {} pos {} high bytes", len, pos);
+            }
+        }
+    }
+
+    #[test]
+    fn three_byte_insertion() {
+        for byte in 0..=3 {
+            assert_eq!(emulation_prevented(&[0x00, 0x00, byte]), [0x00, 0x00, 0x03, byte]);
+        }
+        assert_eq!(emulation_prevented(&[0x00, 0x00, 0x04]), [0x00, 0x00, 0x04]);
+        assert_eq!(emulation_prevented(&[0x00, 0x01, 0x00, 0x02]), [0x00, 0x01, 0x00, 0x02]);
+        assert_eq!(emulation_prevented(&[0x00, 0x00, 0x00, 0x00, 0x00]), [0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00]);
+        // Trailing zeros get no three byte, as nothing follows them
+        assert_eq!(emulation_prevented(&[0x11, 0x00, 0x00]), [0x11, 0x00, 0x00]);
+        // Runs across the 8-byte words of the zero search
+        for start in 0..20 {
+            let mut rbsp = vec![0x5a; 24];
+            rbsp[start..start + 3].copy_from_slice(&[0x00, 0x00, 0x01]);
+            let mut expected = rbsp[..start + 2].to_vec();
+            expected.push(0x03);
+            expected.extend_from_slice(&rbsp[start + 2..]);
+            assert_eq!(emulation_prevented(&rbsp), expected, "start {}", start);
+        }
+    }
+
+    #[test]
+    fn zeros_carried_between_calls() {
+        let mut buf = [0; 16];
+        let mut out = Writer::new(&mut buf);
+        let mut zeros = 0;
+        write_emulation_prevented(&mut out, &[0x22, 0x00], &mut zeros);
+        write_emulation_prevented(&mut out, &[0x00], &mut zeros);
+        write_emulation_prevented(&mut out, &[0x02, 0x33], &mut zeros);
+        let len = out.len();
+        assert_eq!(&buf[..len], [0x22, 0x00, 0x00, 0x03, 0x02, 0x33]);
+    }
+
+    #[test]
+    fn matches_reference() {
+        let mut seed: u32 = 1;
+        for len in 0..200 {
+            let rbsp: Vec<u8> = (0..len).map(|_| {
+                seed = seed.wrapping_mul(1_103_515_245).wrapping_add(12_345);
+                match seed >> 29 { 0..=3 => 0x00, 4 => 0x03, 5 => 0x01, _ => (seed >> 16) as u8 }
+            }).collect();
+            assert_eq!(emulation_prevented(&rbsp), reference(&rbsp), "{:02x?}", rbsp);
+        }
+    }
+
+    #[test]
+    fn max_size_bounds_output() {
+        // All-zero payloads insert the most three bytes
+        let payloads: [&[u8]; 3] = [&[0; 125], &[0; 65], &[0; 60]];
+        let sizes = [125, 65, 60];
+        for codec in [BPM_CODEC_AVC, BPM_CODEC_HEVC, BPM_CODEC_AV1].iter() {
+            for framing in [BPM_FRAMING_ANNEXB, BPM_FRAMING_LENGTH].iter() {
+                let mut buf = [0; 512];
+                let mut out = Writer::new(&mut buf);
+                assert!(write_payloads(&mut out, *codec, *framing, &payloads));
+                let max_size = max_size(*codec, *framing, &sizes).unwrap();
+                assert!(out.len() <= max_size, "codec {} framing {}: {} > {}", codec, framing, out.len(), max_size);
+            }
+        }
+        assert_eq!(max_size(3, BPM_FRAMING_ANNEXB, &sizes), None);
+        assert_eq!(max_size(BPM_CODEC_AVC, 2, &sizes), None);
+    }
+
+    #[test]
+    fn length_prefix() {
+        let mut buf = [0; 64];
+        let mut out = Writer::new(&mut buf);
+        assert!(write_payloads(&mut out, BPM_CODEC_AVC, BPM_FRAMING_LENGTH, &[&[0x00, 0x00, 0x01]]));
+        let len = out.len();
+        // SEI header, type 5, size 3, payload with a three byte, trailing bits
+        assert_eq!(&buf[..len], [0x00, 0x00, 0x00, 0x08, 0x06, 0x05, 0x03, 0x00, 0x00, 0x03, 0x01, 0x80]);
+    }
+}
@@ -0,0 +1,580 @@
+//! Independent broadcast session: track table, last sent metrics and settings.
+//! Each session has its own locks, so sessions never contend with each other.
+
+use chrono::Utc;
+use parking_lot::{Mutex, RwLock};
+use std::sync::atomic::{fence, AtomicBool, AtomicI32, AtomicI64, AtomicU32, AtomicU64, AtomicU8, Ordering};
+
+use crate::clock;
+use crate::fingerprints::FingerprintIndex;
+use crate::exporter::Exporter;
+use crate::local::LocalCounters;
+use crate::rates::{self, BpmRates};
+use crate::record::{Record, Recorder, BPM_RECORD_FRAMES, BPM_RECORD_MARK, BPM_RECORD_TRACK};
+use crate::shm::Publisher;
+use crate::stats;
+use crate::tracks::{Track, TrackTable, MAX_TRACKS};
+use crate::{BPM_TS_EVENT_FER, BPM_TS_EVENT_FERC, TS_TYPE_DURATION, TS_TYPE_RFC3339};
+
+/// Values sent in the last metrics of a track
+#[derive(Clone, Copy, Default)]
+pub struct TrackRefs {
+    // Session metrics
+    pub sm_rendered: u64,
+    pub sm_lagged: u64,
+    pub sm_dropped: u64,
+    pub sm_output: u64,
+
+    // Encoded Rendition Metrics
+    pub erm_input: u64,
+    pub erm_skipped: u64,
+    pub erm_output: u64,
+}
+
+/// Last sent values of a track, written by renders under the state lock and read
+/// lock-free by snapshots, which retry while the sequence number is odd or changes.
+#[derive(Default)]
+pub struct SentRefs {
+    seq: AtomicU32,
+    values: [AtomicU64; 7],
+}
+
+impl SentRefs {
+    /// Values with the state lock held, no writer can run concurrently
+    pub fn load(&self, _state: &State) -> TrackRefs {
+        self.get()
+    }
+
+    pub fn store(&self, _state: &mut State, refs: &TrackRefs) {
+        let seq = self.seq.load(Ordering::Relaxed);
+        self.seq.store(seq.wrapping_add(1), Ordering::Relaxed);
+        fence(Ordering::Release);
+        let values = [refs.sm_rendered, refs.sm_lagged, refs.sm_dropped, refs.sm_output,
+                      refs.erm_input, refs.erm_skipped, refs.erm_output];
+        for (slot, value) in self.values.iter().zip(values) {
+            slot.store(value, Ordering::Relaxed);
+        }
+        self.seq.store(seq.wrapping_add(2), Ordering::Release);
+    }
+
+    /// Consistent values of one render without taking the state lock
+    pub fn read(&self) -> TrackRefs {
+        loop {
+            let seq = self.seq.load(Ordering::Acquire);
+            if seq & 1 == 0 {
+                let refs = self.get();
+                fence(Ordering::Acquire);
+                if self.seq.load(Ordering::Relaxed) == seq {
+                    return refs;
+                }
+            }
+            std::hint::spin_loop();
+        }
+    }
+
+    fn get(&self) -> TrackRefs {
+        let value = |idx: usize| self.values[idx].load(Ordering::Relaxed);
+        TrackRefs {
+            sm_rendered: value(0),
+            sm_lagged: value(1),
+            sm_dropped: value(2),
+            sm_output: value(3),
+            erm_input: value(4),
+            erm_skipped: value(5),
+            erm_output: value(6),
+        }
+    }
+}
+
+/// Session counters shared by the SM renders of all tracks for one keyframe
+#[derive(Clone, Copy)]
+pub struct SmEpoch {
+    pub totals: SessionCounters,
+    pub started_ms: i64,
+}
+
+// Renders of the same keyframe land well within this, the next keyframe follows in seconds
+const SM_EPOCH_MAX_AGE_MS: i64 = 500;
+
+pub struct State {
+    pub track_map: Vec<Option<String>>, // Track fingerprints for index in the track table, None if used unregistered
+    pub exporter: Option<Exporter>,     // Out-of-band export of the rendered deltas
+    pub shm: Option<Publisher>,         // Counters published to other processes
+    pub sm_epoch: Option<SmEpoch>,      // Session counters of the current keyframe, with shared SM
+}
+
+/// Session metrics summed over the per-track counters
+#[derive(Clone, Copy)]
+pub struct SessionCounters {
+    pub sm_rendered: u64, // Frames rendered by compositor
+    pub sm_lagged: u64,   // Frames lagged by compositor
+    pub sm_dropped: u64,  // Frames dropped due to network congestion
+    pub sm_output: u64,   // Sum of all video encoder rendition sinks
+}
+
+/// Encoded rendition metrics of a single track
+pub struct RenditionCounters {
+    pub erm_input: u64,   // Frames input to the encoder rendition
+    pub erm_skipped: u64, // Frames skipped by the encoder rendition
+    pub erm_output: u64,  // Frames output (encoded) by the encoder rendition
+}
+
+pub const BPM_EVENT_ENCODED: u32 = 0;   // Frames encoded successfully
+pub const BPM_EVENT_LAGGED: u32 = 1;    // Frames lagged while encoding
+pub const BPM_EVENT_DROPPED: u32 = 2;   // Frames dropped due to network congestion
+pub const BPM_EVENT_BYTES_DROPPED: u32 = 3; // Bytes of the frames dropped due to network congestion, count in bytes
+
+/// Frame event of a batch, counting as count calls of bpm_frame_encoded, _lagged or _dropped,
+/// or as bpm_bytes_dropped of count bytes
+#[repr(C)]
+pub struct BpmEvent {
+    pub track_idx: u32,
+    pub kind: u32,
+    pub count: u32,
+}
+
+pub struct Session {
+    pub state: Mutex<State>,    // Taken by registration and renders only, through lock_state
+    pub tracks: TrackTable,
+    fingerprints: FingerprintIndex,
+    local: LocalCounters,       // Thread-local counters, summed in renders
+    local_mode: AtomicBool,     // Count frames in thread-local counters
+    shared_sm: AtomicBool,      // Sum the session counters once per keyframe for all tracks
+    rates: AtomicBool,          // Advance the rate windows of the tracks in the frame calls
+    drop_attribution: AtomicBool,   // Keep network drops out of the skipped frames of the ERM
+    timestamp_clock: AtomicI32,
+    timestamp_type: AtomicU8,   // TS_TYPE_* of the timestamps in the payloads
+    fixed_now_ms: AtomicI64,    // Current time of the renders if not 0, for reproducible payloads
+    recording: AtomicBool,      // A recorder is running, checked before taking its lock
+    recorder: RwLock<Option<Recorder>>,
+}
+
+impl Session {
+    pub const fn new() -> Session {
+        Session {
+            state: Mutex::new(State { track_map: Vec::new(), exporter: None, shm: None, sm_epoch: None }),
+            tracks: TrackTable::new(),
+            fingerprints: FingerprintIndex::new(),
+            local: LocalCounters::new(),
+            local_mode: AtomicBool::new(false),
+            shared_sm: AtomicBool::new(false),
+            rates: AtomicBool::new(false),
+            drop_attribution: AtomicBool::new(false),
+            timestamp_clock: AtomicI32::new(clock::BPM_CLOCK_UTC_MS),
+            timestamp_type: AtomicU8::new(TS_TYPE_RFC3339),
+            fixed_now_ms: AtomicI64::new(0),
+            recording: AtomicBool::new(false),
+            recorder: RwLock::new(None),
+        }
+    }
+
+    /// Lock of the state, timed with the `stats` feature
+    #[inline]
+    pub fn lock_state(&self) -> stats::Locked<'_, State> {
+        stats::lock(&self.state)
+    }
+
+    /// Index of an already registered track fingerprint, without locking or allocating
+    #[inline]
+    pub fn find_track_index(&self, hash: u64, fingerprint: &[u8]) -> Option<usize> {
+        self.fingerprints.find(hash, fingerprint)
+    }
+
+    /// Index of a track fingerprint, registering it if new. A new fingerprint gets an index
+    /// not in use yet, so it never shares a track counted by index. None if the track table is full.
+    pub fn get_track_index(&self, fingerprint: String) -> Option<usize> {
+        let mut state = self.lock_state();
+        if let Some(index) = state.track_map.iter().position(|x| x.as_deref() == Some(fingerprint.as_str())) {
+            Some(index)
+        } else {
+            let index = state.track_map.len().max(self.tracks.len());
+            if index >= MAX_TRACKS {
+                return None;
+            }
+            self.record(|| Record::new(BPM_RECORD_TRACK, 0, index as u32, [0; 4]));
+            self.tracks.get_or_insert(index);
+            self.fingerprints.insert(fingerprint.as_bytes(), index);
+            state.track_map.resize(index, None);
+            state.track_map.push(Some(fingerprint));
+            Some(index)
+        }
+    }
+
+    /// Track for the per-frame, mark, render and handle calls, created on first use for callers
+    /// that know their indices. None beyond the track table.
+    #[inline]
+    pub fn track(&self, track_idx: u32) -> Option<&Track> {
+        self.tracks.get_or_insert(track_idx as usize)
+    }
+
+    /// Add to a frame counter (BPM_EVENT_*). Returns false for an unknown kind or an index beyond the track table.
+    #[inline]
+    pub fn add_frames(&self, track_idx: u32, kind: u32, count: u32) -> bool {
+        match self.track(track_idx) {
+            Some(track) => self.count_frames(track, track_idx, kind, count),
+            None => false,
+        }
+    }
+
+    /// Add to a frame counter of a track already looked up
+    #[inline]
+    pub fn count_frames(&self, track: &Track, track_idx: u32, kind: u32, count: u32) -> bool {
+        if self.rates.load(Ordering::Relaxed) {
+            track.rates.tick(|| self.frame_counts(track_idx as usize));
+        }
+        self.recorded(|| Record::new(BPM_RECORD_FRAMES, kind as u16, track_idx, [count as i64, 0, 0, 0]), || {
+            if self.local_mode.load(Ordering::Relaxed) {
+                return self.local.add(track_idx as usize, kind, count);
+            }
+            match track.counters.counter(kind) {
+                Some(counter) => {
+                    counter.fetch_add(count as u64, Ordering::Relaxed);
+                    true
+                },
+                None => false,
+            }
+        })
+    }
+
+    pub fn frame_encoded(&self, track_idx: u32) {
+        stats::count(stats::BPM_STAT_FRAME_ENCODED);
+        self.add_frames(track_idx, BPM_EVENT_ENCODED, 1);
+    }
+
+    pub fn frame_lagged(&self, track_idx: u32) {
+        stats::count(stats::BPM_STAT_FRAME_LAGGED);
+        self.add_frames(track_idx, BPM_EVENT_LAGGED, 1);
+    }
+
+    pub fn frame_dropped(&self, track_idx: u32) {
+        stats::count(stats::BPM_STAT_FRAME_DROPPED);
+        self.add_frames(track_idx, BPM_EVENT_DROPPED, 1);
+    }
+
+    /// Apply a batch of frame events. Returns false if any event has an unknown kind or index, the others are applied.
+    pub fn frames_report(&self, events: &[BpmEvent]) -> bool {
+        stats::count(stats::BPM_STAT_FRAMES_REPORT);
+        let mut valid = true;
+        for event in events {
+            valid &= self.add_frames(event.track_idx, event.kind, event.count);
+        }
+        return valid;
+    }
+
+    /// Count frames in thread-local counters instead of shared atomics.
+    /// Counts made in either mode are kept and summed in renders.
+    pub fn set_local_counters(&self, enabled: bool) {
+        self.local_mode.store(enabled, Ordering::Relaxed);
+    }
+
+    /// Sum the session counters once per keyframe and share them between the SM renders of all tracks
+    pub fn set_shared_sm(&self, enabled: bool) {
+        self.shared_sm.store(enabled, Ordering::Relaxed);
+    }
+
+    /// Session counters for the SM render of a track that last sent refs. With shared SM, the
+    /// counters of the current keyframe epoch. A new epoch starts when the track already rendered
+    /// in the current one, or when it is too old. A track that skipped an epoch still gets the delta
+    /// since its own last render, as the delta is always taken against its refs.
+    pub fn sm_counters(&self, state: &mut State, refs: &TrackRefs, now_ms: i64) -> SessionCounters {
+        if !self.shared_sm.load(Ordering::Relaxed) {
+            return self.session_counters();
+        }
+
+        if let Some(epoch) = state.sm_epoch {
+            let rendered = epoch.totals.sm_rendered == refs.sm_rendered && epoch.totals.sm_lagged == refs.sm_lagged
+                && epoch.totals.sm_dropped == refs.sm_dropped && epoch.totals.sm_output == refs.sm_output;
+            let age_ms = now_ms - epoch.started_ms;
+            if !rendered && (0..SM_EPOCH_MAX_AGE_MS).contains(&age_ms) {
+                return epoch.totals;
+            }
+        }
+
+        let totals = self.session_counters();
+        state.sm_epoch = Some(SmEpoch { totals, started_ms: now_ms });
+        return totals;
+    }
+
+    /// Advance the rate windows in the frame calls, which then read the clock
+    pub fn set_rates(&self, enabled: bool) {
+        self.rates.store(enabled, Ordering::Relaxed);
+    }
+
+    /// Report network drops only in the SM and the per-track drop counters, not as ERM skipped frames
+    pub fn set_drop_attribution(&self, enabled: bool) {
+        self.drop_attribution.store(enabled, Ordering::Relaxed);
+    }
+
+    /// Frame rates of a track over a BPM_RATE_WINDOW_*. None for an unknown window.
+    pub fn track_rates(&self, track_idx: u32, window: u32) -> Option<BpmRates> {
+        match self.tracks.get(track_idx as usize) {
+            Some(track) => track.rates.query(window, || self.frame_counts(track_idx as usize)),
+            None => rates::is_window(window).then(BpmRates::default),
+        }
+    }
+
+    /// Encoded, lagged and dropped frames of a track, including the thread-local counts
+    pub fn frame_counts(&self, track_idx: usize) -> [u64; 3] {
+        let track = match self.tracks.get(track_idx) {
+            Some(track) => &track.counters,
+            None => return [0; 3],
+        };
+        let local = self.local.sum(track_idx);
+        [
+            track.encoded.load(Ordering::Relaxed) + local[0],
+            track.lagged.load(Ordering::Relaxed) + local[1],
+            track.dropped.load(Ordering::Relaxed) + local[2],
+        ]
+    }
+
+    /// Bytes of the frames of a track dropped due to network congestion, including the thread-local counts
+    pub fn bytes_dropped(&self, track_idx: usize) -> u64 {
+        match self.tracks.get(track_idx) {
+            Some(track) => track.counters.bytes_dropped.load(Ordering::Relaxed) + self.local.sum(track_idx)[3],
+            None => 0,
+        }
+    }
+
+    /// Record a frame event (1-based BPM_TS_EVENT_*) on the session clock. If 0, use current time.
+    pub fn mark_event(&self, track_idx: u32, event: u8, frame_id: u64, ts: i64) {
+        stats::count(stats::BPM_STAT_MARK);
+        let clock = self.timestamp_clock.load(Ordering::Relaxed);
+        let utc_us = if ts > 0 { clock::to_utc_us(clock, ts) } else { self.now_us() };
+        self.mark_at(track_idx, event, frame_id, utc_us);
+    }
+
+    /// Record a frame event at a time in UTC micros
+    pub fn mark_at(&self, track_idx: u32, event: u8, frame_id: u64, utc_us: i64) {
+        self.record(|| Record::new(BPM_RECORD_MARK, event as u16, track_idx, [frame_id as i64, utc_us, 0, 0]));
+        if let Some(track) = self.track(track_idx) {
+            track.marks.mark((event - 1) as usize, frame_id, utc_us);
+            if event == BPM_TS_EVENT_FERC {
+                let fer_us = track.marks.timestamp_us((BPM_TS_EVENT_FER - 1) as usize, frame_id);
+                if fer_us != 0 && utc_us >= fer_us {
+                    track.latency.record((utc_us - fer_us) as u64);
+                }
+            }
+        }
+    }
+
+    /// Recorded event times of a frame in UTC millis in the order CTS, FER, FERC, PIR, 0 if not recorded
+    pub fn marks(&self, track_idx: u32, frame_id: u64) -> [i64; 4] {
+        match self.tracks.get(track_idx as usize) {
+            Some(track) => track.marks.timestamps(frame_id),
+            None => [0; 4],
+        }
+    }
+
+    /// Export the rendered deltas to StatsD, replacing a running exporter. Returns false if it cannot start.
+    pub fn start_exporter(&self, addr: &str, prefix: String, interval_ms: u32) -> bool {
+        let exporter = match Exporter::start(addr, prefix, interval_ms) {
+            Some(exporter) => exporter,
+            None => return false,
+        };
+        let previous = self.lock_state().exporter.replace(exporter);
+        drop(previous);
+        return true;
+    }
+
+    /// Stop the exporter after sending the queued deltas
+    pub fn stop_exporter(&self) {
+        let previous = self.lock_state().exporter.take();
+        drop(previous);
+    }
+
+    /// Publish the counters in a shared-memory segment, replacing a running publisher. Returns false if it cannot start.
+    pub fn start_shm(&self, name: &str, interval_ms: u32) -> bool {
+        let previous = self.lock_state().shm.take();
+        drop(previous);
+        let publisher = match Publisher::start(self, name, interval_ms) {
+            Some(publisher) => publisher,
+            None => return false,
+        };
+        let previous = self.lock_state().shm.replace(publisher);
+        drop(previous);
+        return true;
+    }
+
+    /// Stop publishing and unlink the segment
+    pub fn stop_shm(&self) {
+        let previous = self.lock_state().shm.take();
+        drop(previous);
+    }
+
+    /// Log the calls to a file for replay, replacing a running recording. Returns false if the file cannot be created.
+    pub fn start_recording(&self, path: &str) -> bool {
+        let recorder = match Recorder::start(path) {
+            Some(recorder) => recorder,
+            None => return false,
+        };
+        // Tracks registered before the recording, so the replay counts their frames
+        let state = self.lock_state();
+        for idx in 0..self.tracks.len() {
+            recorder.push(Record::new(BPM_RECORD_TRACK, 0, idx as u32, [0; 4]));
+        }
+        let previous = self.recorder.write().replace(recorder);
+        self.recording.store(true, Ordering::Relaxed);
+        drop(state);
+        drop(previous);
+        return true;
+    }
+
+    /// Stop the recording after writing the logged calls
+    pub fn stop_recording(&self) {
+        self.recording.store(false, Ordering::Relaxed);
+        let previous = self.recorder.write().take();
+        drop(previous);
+    }
+
+    /// Log a call if recording
+    #[inline]
+    pub fn record(&self, record: impl FnOnce() -> Record) {
+        if self.recording.load(Ordering::Relaxed) {
+            if let Some(recorder) = self.recorder.read().as_ref() {
+                recorder.push(record());
+            }
+        }
+    }
+
+    /// Update or read counters, logging the call with them if recording. The renders log the
+    /// counters they read in the order of the counter updates, so a replay reads the same ones.
+    #[inline]
+    pub fn recorded<R>(&self, record: impl FnOnce() -> Record, counters: impl FnOnce() -> R) -> R {
+        if self.recording.load(Ordering::Relaxed) {
+            if let Some(recorder) = self.recorder.read().as_ref() {
+                return recorder.push_with(record(), counters);
+            }
+        }
+        counters()
+    }
+
+    /// Render with a fixed current time in UTC millis, 0 for the system clock
+    pub fn set_fixed_time(&self, utc_ms: i64) {
+        self.fixed_now_ms.store(utc_ms, Ordering::Relaxed);
+    }
+
+    /// Current time of the renders in UTC millis
+    #[inline]
+    pub fn now_ms(&self) -> i64 {
+        match self.fixed_now_ms.load(Ordering::Relaxed) {
+            0 => Utc::now().timestamp_millis(),
+            fixed => fixed,
+        }
+    }
+
+    /// Current time of the marks in UTC micros
+    pub fn now_us(&self) -> i64 {
+        match self.fixed_now_ms.load(Ordering::Relaxed) {
+            0 => Utc::now().timestamp_micros(),
+            fixed => fixed * 1000,
+        }
+    }
+
+    /// Select the clock of the 64-bit timestamps. Returns false for an unknown clock.
+    pub fn set_timestamp_clock(&self, clock: i32) -> bool {
+        if !clock::prepare(clock) {
+            return false;
+        }
+        self.timestamp_clock.store(clock, Ordering::Relaxed);
+        return true;
+    }
+
+    /// Select the encoding of the timestamps in the payloads. Returns false for an unknown type.
+    pub fn set_timestamp_type(&self, ts_type: i32) -> bool {
+        if ts_type != TS_TYPE_RFC3339 as i32 && ts_type != TS_TYPE_DURATION as i32 {
+            return false;
+        }
+        self.timestamp_type.store(ts_type as u8, Ordering::Relaxed);
+        return true;
+    }
+
+    #[inline]
+    pub fn timestamp_type(&self) -> u8 {
+        self.timestamp_type.load(Ordering::Relaxed)
+    }
+
+    /// Timestamp on the session clock in UTC millis
+    pub fn to_utc_ms(&self, timestamp: i64) -> i64 {
+        clock::to_utc_ms(self.timestamp_clock.load(Ordering::Relaxed), timestamp)
+    }
+
+    pub fn session_counters(&self) -> SessionCounters {
+        let mut sm = SessionCounters { sm_rendered: 0, sm_lagged: 0, sm_dropped: 0, sm_output: 0 };
+        for idx in 0..self.tracks.len() {
+            let [encoded, lagged, dropped] = self.frame_counts(idx);
+            // Spec: "The primary, highest quality video track must be packaged
+            // and sent as enhanced RTMP single-track video packets" = track 0
+            if idx == 0 {
+                sm.sm_rendered = encoded;
+            }
+            sm.sm_output += encoded;
+            sm.sm_lagged += lagged;
+            sm.sm_dropped += dropped;
+        }
+        return sm;
+    }
+
+    pub fn rendition_counters(&self, track_idx: usize) -> RenditionCounters {
+        let [encoded, lagged, dropped] = self.frame_counts(track_idx);
+        // With drop attribution, frames dropped by the network after the encoder are not its skips
+        let skipped = if self.drop_attribution.load(Ordering::Relaxed) { lagged } else { lagged + dropped };
+        RenditionCounters {
+            erm_input: encoded + skipped,
+            erm_skipped: skipped,
+            erm_output: encoded,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::convert::TryInto;
+
+    #[test]
+    fn known_index_counts_without_registration() {
+        let session = Session::new();
+        for _ in 0..5 {
+            session.frame_encoded(2);
+        }
+        session.frame_lagged(2);
+        assert!(session.frames_report(&[BpmEvent { track_idx: 2, kind: BPM_EVENT_DROPPED, count: 3 }]));
+        assert_eq!(session.frame_counts(2), [5, 1, 3]);
+        assert_eq!(session.tracks.len(), 3);
+
+        let erm = session.rendition_counters(2);
+        assert_eq!((erm.erm_input, erm.erm_skipped, erm.erm_output), (9, 4, 5));
+        let sm = session.session_counters();
+        assert_eq!((sm.sm_rendered, sm.sm_lagged, sm.sm_dropped, sm.sm_output), (0, 1, 3, 5));
+
+        let mut erm_data = [0; crate::BPM_ERM_SIZE];
+        let mut written = 0;
+        let rc = crate::bpm_session_render_erm_into(&session as *const Session as *mut Session, 2, erm_data.as_mut_ptr(),
+                                                    erm_data.len() as u32, &mut written);
+        assert_eq!(rc, 0);
+        let counter = |i: usize| u32::from_be_bytes(erm_data[46 + 5 * i..50 + 5 * i].try_into().unwrap());
+        assert_eq!([counter(0), counter(1), counter(2)], [9, 4, 5]);
+    }
+
+    #[test]
+    fn registration_skips_indices_in_use() {
+        let session = Session::new();
+        session.frame_encoded(1);
+        assert_eq!(session.get_track_index("main".to_string()), Some(2));
+        assert_eq!(session.get_track_index("main".to_string()), Some(2));
+        assert_eq!(session.find_track_index(crate::fingerprints::fingerprint_hash(b"main"), b"main"), Some(2));
+        // A handle creates the track like a frame call, and the next registration moves past it
+        assert!(session.track(4).is_some());
+        assert_eq!(session.get_track_index("second".to_string()), Some(5));
+        assert_eq!(session.frame_counts(1), [1, 0, 0]);
+        assert_eq!(session.frame_counts(2), [0, 0, 0]);
+    }
+
+    #[test]
+    fn index_beyond_table() {
+        let session = Session::new();
+        assert!(!session.add_frames(MAX_TRACKS as u32, BPM_EVENT_ENCODED, 1));
+        assert!(session.track(MAX_TRACKS as u32).is_none());
+        assert_eq!(session.tracks.len(), 0);
+    }
+}
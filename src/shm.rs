@@ -0,0 +1,238 @@
+//! Session counters published in a named POSIX shared-memory segment for other processes.
+//!
+//! A background thread copies a snapshot of the session into the segment every interval,
+//! between two increments of a sequence number in its header. Readers mmap the segment
+//! read-only and retry while the sequence number is odd or changes, so they never take a
+//! lock or make a call into the encoder process.
+
+use std::ffi::CString;
+use std::io;
+use std::mem::{self, size_of};
+use std::ptr;
+use std::sync::atomic::{fence, AtomicBool, AtomicU32, AtomicU64, Ordering};
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use std::time::Duration;
+
+use crate::session::Session;
+use crate::snapshot::{self, BpmSnapshot};
+
+pub const BPM_SHM_MAGIC: u32 = 0x314d_5042;    // "BPM1" in little endian
+pub const BPM_SHM_VERSION: u32 = 3;
+
+const WORDS: usize = size_of::<BpmSnapshot>() / 8;
+const SEGMENT_SIZE: usize = size_of::<BpmShmHeader>() + WORDS * 8;
+const READ_ATTEMPTS: u32 = 1024;
+
+/// Start of the segment, followed by the snapshot
+#[repr(C)]
+pub struct BpmShmHeader {
+    pub magic: AtomicU32,   // BPM_SHM_MAGIC once the segment is initialized
+    pub version: u32,       // BPM_SHM_VERSION, layout of the segment
+    pub size: u32,          // Bytes in the segment
+    pub seq: AtomicU32,     // Odd while the snapshot is written
+    pub pid: u32,           // Process publishing the segment
+    pub interval_ms: u32,   // Period of the updates
+}
+
+const _: () = assert!(size_of::<BpmSnapshot>() % 8 == 0 && size_of::<BpmShmHeader>() % 8 == 0);
+
+struct Mapping {
+    base: *mut u8,
+    name: CString,
+}
+
+// The mapping is only written by the publisher thread
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    /// New segment, or None if the name is taken by a live publisher. A segment left by a
+    /// publisher that died is unlinked and created again.
+    fn create(name: &str) -> Option<Mapping> {
+        let name = CString::new(name).ok()?;
+        unsafe {
+            let flags = libc::O_CREAT | libc::O_EXCL | libc::O_RDWR;
+            let mut fd = libc::shm_open(name.as_ptr(), flags, 0o644);
+            if fd < 0 && io::Error::last_os_error().raw_os_error() == Some(libc::EEXIST) && is_stale(&name) {
+                libc::shm_unlink(name.as_ptr());
+                fd = libc::shm_open(name.as_ptr(), flags, 0o644);
+            }
+            if fd < 0 {
+                return None;
+            }
+            if libc::ftruncate(fd, SEGMENT_SIZE as libc::off_t) != 0 {
+                libc::close(fd);
+                libc::shm_unlink(name.as_ptr());
+                return None;
+            }
+            let base = libc::mmap(ptr::null_mut(), SEGMENT_SIZE, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, fd, 0);
+            libc::close(fd);
+            if base == libc::MAP_FAILED {
+                libc::shm_unlink(name.as_ptr());
+                return None;
+            }
+            Some(Mapping { base: base as *mut u8, name })
+        }
+    }
+
+    fn header(&self) -> &BpmShmHeader {
+        unsafe { &*(self.base as *const BpmShmHeader) }
+    }
+
+    fn words(&self) -> &[AtomicU64; WORDS] {
+        unsafe { words(self.base) }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.base as *mut libc::c_void, SEGMENT_SIZE);
+            libc::shm_unlink(self.name.as_ptr());
+        }
+    }
+}
+
+/// Existing segment whose publisher is no longer running. A segment without a pid yet is
+/// still being created, and one that cannot be read is left alone.
+unsafe fn is_stale(name: &CString) -> bool {
+    let fd = libc::shm_open(name.as_ptr(), libc::O_RDONLY, 0);
+    if fd < 0 {
+        return false;
+    }
+    let mut stat: libc::stat = mem::zeroed();
+    let header_size = size_of::<BpmShmHeader>();
+    let base = if libc::fstat(fd, &mut stat) == 0 && stat.st_size as usize >= header_size {
+        libc::mmap(ptr::null_mut(), header_size, libc::PROT_READ, libc::MAP_SHARED, fd, 0)
+    } else {
+        libc::MAP_FAILED
+    };
+    libc::close(fd);
+    if base == libc::MAP_FAILED {
+        return false;
+    }
+    let pid = ptr::addr_of!((*(base as *const BpmShmHeader)).pid).read_volatile();
+    libc::munmap(base, header_size);
+    // EPERM: the process exists under another user
+    pid != 0 && libc::kill(pid as libc::pid_t, 0) != 0
+        && io::Error::last_os_error().raw_os_error() == Some(libc::ESRCH)
+}
+
+unsafe fn words<'a>(base: *const u8) -> &'a [AtomicU64; WORDS] {
+    &*(base.add(size_of::<BpmShmHeader>()) as *const [AtomicU64; WORDS])
+}
+
+/// Pointer to the session for the publisher thread. The publisher is dropped with the
+/// session state, which is dropped before the tracks it reads.
+struct SessionPtr(*const Session);
+
+unsafe impl Send for SessionPtr {}
+
+impl SessionPtr {
+    fn get(&self) -> &Session {
+        unsafe { &*self.0 }
+    }
+}
+
+struct Shared {
+    mapping: Mapping,
+    stop: AtomicBool,
+}
+
+/// Running publisher, stopped and joined on drop, which also unlinks the segment
+pub struct Publisher {
+    shared: Arc<Shared>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl Publisher {
+    /// Publish the counters of session in the segment name, e.g. "/bpm", every interval_ms
+    pub fn start(session: &Session, name: &str, interval_ms: u32) -> Option<Publisher> {
+        let mapping = Mapping::create(name)?;
+        let interval_ms = interval_ms.max(1);
+        // A segment left by an earlier writer stays invalid until it is written again
+        mapping.header().magic.store(0, Ordering::Relaxed);
+        mapping.header().seq.store(0, Ordering::Relaxed);
+        unsafe {
+            let header = mapping.base as *mut BpmShmHeader;
+            ptr::addr_of_mut!((*header).version).write(BPM_SHM_VERSION);
+            ptr::addr_of_mut!((*header).size).write(SEGMENT_SIZE as u32);
+            ptr::addr_of_mut!((*header).pid).write(libc::getpid() as u32);
+            ptr::addr_of_mut!((*header).interval_ms).write(interval_ms);
+        }
+        let shared = Arc::new(Shared { mapping, stop: AtomicBool::new(false) });
+        publish(session, &shared.mapping);
+        shared.mapping.header().magic.store(BPM_SHM_MAGIC, Ordering::Release);
+
+        let publisher = shared.clone();
+        let session = SessionPtr(session);
+        let interval = Duration::from_millis(interval_ms as u64);
+        let thread = thread::Builder::new()
+            .name("bpm-shm".to_string())
+            .spawn(move || run(&publisher, session, interval))
+            .ok()?;
+        Some(Publisher { shared, thread: Some(thread) })
+    }
+}
+
+impl Drop for Publisher {
+    fn drop(&mut self) {
+        self.shared.stop.store(true, Ordering::Relaxed);
+        if let Some(thread) = self.thread.take() {
+            thread.thread().unpark();
+            let _ = thread.join();
+        }
+    }
+}
+
+fn run(shared: &Shared, session: SessionPtr, interval: Duration) {
+    while !shared.stop.load(Ordering::Relaxed) {
+        thread::park_timeout(interval);
+        publish(session.get(), &shared.mapping);
+    }
+}
+
+fn publish(session: &Session, mapping: &Mapping) {
+    // Zeroed so that the padding copied to the segment is too
+    let mut snapshot: BpmSnapshot = unsafe { mem::zeroed() };
+    snapshot::take(session, &mut snapshot);
+    let values: [u64; WORDS] = unsafe { mem::transmute(snapshot) };
+
+    let seq = &mapping.header().seq;
+    let start = seq.load(Ordering::Relaxed);
+    seq.store(start.wrapping_add(1), Ordering::Relaxed);
+    fence(Ordering::Release);
+    for (word, value) in mapping.words().iter().zip(values) {
+        word.store(value, Ordering::Relaxed);
+    }
+    seq.store(start.wrapping_add(2), Ordering::Release);
+}
+
+/// Consistent copy of the snapshot in a mapped segment. Returns false if the segment is
+/// not initialized or has another layout, or stays mid-update, e.g. after its writer died.
+pub unsafe fn read(segment: *const u8, out: &mut BpmSnapshot) -> bool {
+    let header = &*(segment as *const BpmShmHeader);
+    if header.magic.load(Ordering::Acquire) != BPM_SHM_MAGIC
+        || header.version != BPM_SHM_VERSION
+        || header.size as usize != SEGMENT_SIZE {
+        return false;
+    }
+    let words = words(segment);
+    for _ in 0..READ_ATTEMPTS {
+        let seq = header.seq.load(Ordering::Acquire);
+        if seq & 1 == 0 {
+            let mut values = [0u64; WORDS];
+            for (value, word) in values.iter_mut().zip(words.iter()) {
+                *value = word.load(Ordering::Relaxed);
+            }
+            fence(Ordering::Acquire);
+            if header.seq.load(Ordering::Relaxed) == seq {
+                *out = mem::transmute(values);
+                return true;
+            }
+        }
+        std::hint::spin_loop();
+    }
+    return false;
+}
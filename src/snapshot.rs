@@ -0,0 +1,87 @@
+//! Allocation-free copy of the counters and last sent values of a session for monitoring.
+//! Nothing is locked that the per-frame calls or the renders wait on.
+
+use crate::session::Session;
+
+pub const BPM_SNAPSHOT_MAX_TRACKS: usize = 32;
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct BpmTrackSnapshot {
+    // Frames counted since start
+    pub frames_encoded: u64,
+    pub frames_lagged: u64,
+    pub frames_dropped: u64,
+    pub bytes_dropped: u64,
+
+    // Encode latency (FER to FERC marks) of the frames between the last two ERM renders
+    pub encode_frames: u64,
+    pub encode_p50_us: u64,
+    pub encode_p95_us: u64,
+    pub encode_p99_us: u64,
+
+    // Values sent in the last metrics of the track, consistent with one render
+    pub sent_sm_rendered: u64,
+    pub sent_sm_lagged: u64,
+    pub sent_sm_dropped: u64,
+    pub sent_sm_output: u64,
+    pub sent_erm_input: u64,
+    pub sent_erm_skipped: u64,
+    pub sent_erm_output: u64,
+}
+
+#[repr(C)]
+pub struct BpmSnapshot {
+    pub utc_ms: i64,        // Time of the snapshot
+    pub track_count: u32,   // Tracks in use, the first BPM_SNAPSHOT_MAX_TRACKS are copied
+
+    // Session metrics counted since start
+    pub sm_rendered: u64,
+    pub sm_lagged: u64,
+    pub sm_dropped: u64,
+    pub sm_output: u64,
+
+    pub tracks: [BpmTrackSnapshot; BPM_SNAPSHOT_MAX_TRACKS],
+}
+
+pub fn take(session: &Session, out: &mut BpmSnapshot) {
+    out.utc_ms = session.now_ms();
+    out.track_count = session.tracks.len() as u32;
+    out.sm_rendered = 0;
+    out.sm_lagged = 0;
+    out.sm_dropped = 0;
+    out.sm_output = 0;
+    out.tracks = [BpmTrackSnapshot::default(); BPM_SNAPSHOT_MAX_TRACKS];
+
+    for (idx, track) in session.tracks.iter().enumerate() {
+        let [encoded, lagged, dropped] = session.frame_counts(idx);
+        if idx == 0 {
+            out.sm_rendered = encoded;
+        }
+        out.sm_output += encoded;
+        out.sm_lagged += lagged;
+        out.sm_dropped += dropped;
+
+        if idx < BPM_SNAPSHOT_MAX_TRACKS {
+            let sent = track.sent.read();
+            let latency = track.latency.summary();
+            out.tracks[idx] = BpmTrackSnapshot {
+                frames_encoded: encoded,
+                frames_lagged: lagged,
+                frames_dropped: dropped,
+                bytes_dropped: session.bytes_dropped(idx),
+                encode_frames: latency.frames,
+                encode_p50_us: latency.p50_us,
+                encode_p95_us: latency.p95_us,
+                encode_p99_us: latency.p99_us,
+                sent_sm_rendered: sent.sm_rendered,
+                sent_sm_lagged: sent.sm_lagged,
+                sent_sm_dropped: sent.sm_dropped,
+                sent_sm_output: sent.sm_output,
+                sent_erm_input: sent.erm_input,
+                sent_erm_skipped: sent.erm_skipped,
+                sent_erm_output: sent.erm_output,
+            };
+        }
+    }
+}
@@ -0,0 +1,47 @@
+//! Bounded single-producer single-consumer queue.
+//! Push never blocks or allocates, it fails when the queue is full.
+
+use std::cell::UnsafeCell;
+use std::mem::MaybeUninit;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+pub struct Spsc<T: Copy, const N: usize> {
+    slots: [UnsafeCell<MaybeUninit<T>>; N],
+    head: AtomicUsize,  // Next slot to pop, written by the consumer
+    tail: AtomicUsize,  // Next slot to push, written by the producer
+}
+
+// Slots are handed between the threads through head and tail
+unsafe impl<T: Copy + Send, const N: usize> Sync for Spsc<T, N> {}
+
+impl<T: Copy, const N: usize> Spsc<T, N> {
+    pub fn new() -> Spsc<T, N> {
+        Spsc {
+            slots: [const { UnsafeCell::new(MaybeUninit::uninit()) }; N],
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+        }
+    }
+
+    /// Called by the single producer. Returns false if the queue is full.
+    pub fn push(&self, value: T) -> bool {
+        let tail = self.tail.load(Ordering::Relaxed);
+        if tail.wrapping_sub(self.head.load(Ordering::Acquire)) == N {
+            return false;
+        }
+        unsafe { (*self.slots[tail % N].get()).write(value) };
+        self.tail.store(tail.wrapping_add(1), Ordering::Release);
+        return true;
+    }
+
+    /// Called by the single consumer
+    pub fn pop(&self) -> Option<T> {
+        let head = self.head.load(Ordering::Relaxed);
+        if head == self.tail.load(Ordering::Acquire) {
+            return None;
+        }
+        let value = unsafe { (*self.slots[head % N].get()).assume_init() };
+        self.head.store(head.wrapping_add(1), Ordering::Release);
+        Some(value)
+    }
+}
@@ -0,0 +1,238 @@
+//! Self-instrumentation, built with the `stats` feature.
+//!
+//! Counts calls per entry point and records render latencies and the wait and hold
+//! times of the session state lock in log2 histograms. Every thread writes its own
+//! fixed-size block, so recording is a few plain stores. bpm_get_stats sums the blocks.
+//! Without the feature the recording functions compile to nothing.
+
+use parking_lot::{Mutex, MutexGuard};
+use std::ops::{Deref, DerefMut};
+
+pub const BPM_STAT_FRAME_ENCODED: usize = 0;
+pub const BPM_STAT_FRAME_LAGGED: usize = 1;
+pub const BPM_STAT_FRAME_DROPPED: usize = 2;
+pub const BPM_STAT_FRAMES_REPORT: usize = 3;
+pub const BPM_STAT_MARK: usize = 4;
+pub const BPM_STAT_GET_TRACK_INDEX: usize = 5;
+pub const BPM_STAT_RENDER_TS: usize = 6;
+pub const BPM_STAT_RENDER_SM: usize = 7;
+pub const BPM_STAT_RENDER_ERM: usize = 8;
+pub const BPM_STAT_RENDER_KEYFRAME: usize = 9;
+pub const BPM_STAT_RENDER_SEI: usize = 10;
+pub const BPM_STAT_CALLS: usize = 11;
+
+const BPM_STAT_RENDERS: usize = BPM_STAT_CALLS - BPM_STAT_RENDER_TS;
+const BPM_STATS_BUCKETS: usize = 32;         // Bucket i counts durations of [2^(i-1), 2^i) ns, the last one all longer
+
+/// Process-wide statistics of all sessions
+#[repr(C)]
+pub struct BpmStats {
+    pub calls: [u64; BPM_STAT_CALLS],                               // Calls by BPM_STAT_*, session variants included
+    pub render_ns: [[u64; BPM_STATS_BUCKETS]; BPM_STAT_RENDERS],    // Latency by BPM_STAT_RENDER_* - BPM_STAT_RENDER_TS
+    pub render_ns_sum: [u64; BPM_STAT_RENDERS],
+    pub lock_wait_ns: [u64; BPM_STATS_BUCKETS],                     // Time to acquire the session state lock
+    pub lock_wait_ns_sum: u64,
+    pub lock_hold_ns: [u64; BPM_STATS_BUCKETS],                     // Time the session state lock is held
+    pub lock_hold_ns_sum: u64,
+}
+
+#[cfg(feature = "stats")]
+mod enabled {
+    use parking_lot::Mutex;
+    use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+    use std::sync::Arc;
+
+    use super::*;
+
+    struct Histogram {
+        buckets: [AtomicU64; BPM_STATS_BUCKETS],
+        sum: AtomicU64,
+    }
+
+    impl Histogram {
+        const fn new() -> Histogram {
+            Histogram { buckets: [const { AtomicU64::new(0) }; BPM_STATS_BUCKETS], sum: AtomicU64::new(0) }
+        }
+
+        #[inline]
+        fn record(&self, ns: u64) {
+            let bucket = ((u64::BITS - ns.leading_zeros()) as usize).min(BPM_STATS_BUCKETS - 1);
+            bump(&self.buckets[bucket], 1);
+            bump(&self.sum, ns);
+        }
+
+        fn add_to(&self, buckets: &mut [u64; BPM_STATS_BUCKETS], sum: &mut u64) {
+            for (total, bucket) in buckets.iter_mut().zip(self.buckets.iter()) {
+                *total += bucket.load(Ordering::Relaxed);
+            }
+            *sum += self.sum.load(Ordering::Relaxed);
+        }
+    }
+
+    /// Statistics of one thread, written by that thread only
+    struct ThreadStats {
+        calls: [AtomicU64; BPM_STAT_CALLS],
+        renders: [Histogram; BPM_STAT_RENDERS],
+        lock_wait: Histogram,
+        lock_hold: Histogram,
+        in_use: AtomicBool,
+    }
+
+    /// Block of the current thread, released for reuse when the thread exits
+    struct Local(Arc<ThreadStats>);
+
+    impl Drop for Local {
+        fn drop(&mut self) {
+            self.0.in_use.store(false, Ordering::Release);
+        }
+    }
+
+    static THREADS: Mutex<Vec<Arc<ThreadStats>>> = Mutex::new(Vec::new());
+
+    thread_local! {
+        static LOCAL: Local = Local(attach());
+    }
+
+    #[cold]
+    fn attach() -> Arc<ThreadStats> {
+        let mut threads = THREADS.lock();
+        let claimed = threads.iter().find(|stats| {
+            stats.in_use.compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed).is_ok()
+        });
+        if let Some(stats) = claimed {
+            return stats.clone();
+        }
+        let stats = Arc::new(ThreadStats {
+            calls: [const { AtomicU64::new(0) }; BPM_STAT_CALLS],
+            renders: [const { Histogram::new() }; BPM_STAT_RENDERS],
+            lock_wait: Histogram::new(),
+            lock_hold: Histogram::new(),
+            in_use: AtomicBool::new(true),
+        });
+        threads.push(stats.clone());
+        stats
+    }
+
+    // Single writer: no read-modify-write needed
+    #[inline]
+    fn bump(counter: &AtomicU64, value: u64) {
+        counter.store(counter.load(Ordering::Relaxed).wrapping_add(value), Ordering::Relaxed);
+    }
+
+    #[inline]
+    fn with_local(f: impl FnOnce(&ThreadStats)) {
+        // Not available while the thread is exiting
+        let _ = LOCAL.try_with(|local| f(&local.0));
+    }
+
+    #[inline]
+    pub fn count(call: usize) {
+        with_local(|stats| bump(&stats.calls[call], 1));
+    }
+
+    #[inline]
+    pub fn render<T>(call: usize, render: impl FnOnce() -> T) -> T {
+        let start = crate::clock::monotonic_ns();
+        let result = render();
+        let ns = (crate::clock::monotonic_ns() - start) as u64;
+        with_local(|stats| {
+            bump(&stats.calls[call], 1);
+            stats.renders[call - BPM_STAT_RENDER_TS].record(ns);
+        });
+        result
+    }
+
+    #[inline]
+    pub fn lock_acquired(wait_ns: i64) {
+        with_local(|stats| stats.lock_wait.record(wait_ns as u64));
+    }
+
+    #[inline]
+    pub fn lock_released(hold_ns: i64) {
+        with_local(|stats| stats.lock_hold.record(hold_ns as u64));
+    }
+
+    pub fn get(out: &mut BpmStats) -> bool {
+        *out = BpmStats {
+            calls: [0; BPM_STAT_CALLS],
+            render_ns: [[0; BPM_STATS_BUCKETS]; BPM_STAT_RENDERS],
+            render_ns_sum: [0; BPM_STAT_RENDERS],
+            lock_wait_ns: [0; BPM_STATS_BUCKETS],
+            lock_wait_ns_sum: 0,
+            lock_hold_ns: [0; BPM_STATS_BUCKETS],
+            lock_hold_ns_sum: 0,
+        };
+        for stats in THREADS.lock().iter() {
+            for (total, calls) in out.calls.iter_mut().zip(stats.calls.iter()) {
+                *total += calls.load(Ordering::Relaxed);
+            }
+            for (idx, render) in stats.renders.iter().enumerate() {
+                render.add_to(&mut out.render_ns[idx], &mut out.render_ns_sum[idx]);
+            }
+            stats.lock_wait.add_to(&mut out.lock_wait_ns, &mut out.lock_wait_ns_sum);
+            stats.lock_hold.add_to(&mut out.lock_hold_ns, &mut out.lock_hold_ns_sum);
+        }
+        return true;
+    }
+}
+
+#[cfg(not(feature = "stats"))]
+mod enabled {
+    use super::BpmStats;
+
+    #[inline(always)]
+    pub fn count(_call: usize) {}
+
+    #[inline(always)]
+    pub fn render<T>(_call: usize, render: impl FnOnce() -> T) -> T {
+        render()
+    }
+
+    pub fn get(_out: &mut BpmStats) -> bool {
+        false
+    }
+}
+
+pub use enabled::{count, get, render};
+
+/// Session state lock guard, timing the wait and hold of the lock with the `stats` feature
+pub struct Locked<'a, T> {
+    guard: MutexGuard<'a, T>,
+    #[cfg(feature = "stats")]
+    since: i64,
+}
+
+#[inline]
+pub fn lock<T>(mutex: &Mutex<T>) -> Locked<'_, T> {
+    #[cfg(feature = "stats")]
+    {
+        let start = crate::clock::monotonic_ns();
+        let guard = mutex.lock();
+        let since = crate::clock::monotonic_ns();
+        enabled::lock_acquired(since - start);
+        Locked { guard, since }
+    }
+    #[cfg(not(feature = "stats"))]
+    Locked { guard: mutex.lock() }
+}
+
+#[cfg(feature = "stats")]
+impl<T> Drop for Locked<'_, T> {
+    fn drop(&mut self) {
+        enabled::lock_released(crate::clock::monotonic_ns() - self.since);
+    }
+}
+
+impl<T> Deref for Locked<'_, T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        &self.guard
+    }
+}
+
+impl<T> DerefMut for Locked<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        &mut self.guard
+    }
+}
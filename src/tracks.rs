@@ -0,0 +1,166 @@
+//! Growable table of per-track blocks with lock-free lookup.
+//!
+//! Tracks live in segments that are allocated on demand and never move, so the
+//! per-frame calls can index the table without a lock while registration grows it.
+//! Segment 0 holds SEGMENT_BASE tracks and every following segment doubles the capacity.
+//! The table is generic so thread-local shards can hold just the counters of each track.
+
+use parking_lot::Mutex;
+use std::ptr;
+use std::sync::atomic::{AtomicPtr, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+
+use crate::epoch::FrozenKeyframe;
+use crate::latency::EncodeLatency;
+use crate::marks::EventRing;
+use crate::rates::TrackRates;
+use crate::session::{SentRefs, Session, BPM_EVENT_BYTES_DROPPED, BPM_EVENT_DROPPED, BPM_EVENT_ENCODED, BPM_EVENT_LAGGED};
+
+const SEGMENT_BASE: usize = 8;
+const SEGMENTS: usize = 14;
+pub const MAX_TRACKS: usize = SEGMENT_BASE << (SEGMENTS - 1);
+
+/// Per-track frame counters, updated lock-free from the per-frame calls.
+/// Aligned to a cache line so encoder threads of different renditions never share one.
+/// Frames input and frames skipped are derived from these so that a render always
+/// sees a consistent set (input = output + skipped). 64-bit so that long-running sessions
+/// never wrap, at the same cost per increment as 32-bit on 64-bit targets.
+#[repr(align(64))]
+#[derive(Default)]
+pub struct TrackCounters {
+    pub encoded: AtomicU64, // Frames output (encoded) by the encoder rendition
+    pub lagged: AtomicU64,  // Frames lagged while encoding
+    pub dropped: AtomicU64, // Frames dropped due to network congestion
+    pub bytes_dropped: AtomicU64,   // Bytes of the frames dropped due to network congestion
+}
+
+impl TrackCounters {
+    /// Counter of a BPM_EVENT_* kind, None for an unknown kind
+    #[inline]
+    pub fn counter(&self, kind: u32) -> Option<&AtomicU64> {
+        match kind {
+            BPM_EVENT_ENCODED => Some(&self.encoded),
+            BPM_EVENT_LAGGED => Some(&self.lagged),
+            BPM_EVENT_DROPPED => Some(&self.dropped),
+            BPM_EVENT_BYTES_DROPPED => Some(&self.bytes_dropped),
+            _ => None,
+        }
+    }
+}
+
+/// Everything kept per track, contiguous in memory
+pub struct Track {
+    pub counters: TrackCounters,
+    pub sent: SentRefs,
+    pub marks: EventRing,
+    pub epoch: FrozenKeyframe,
+    pub rates: TrackRates,
+    pub latency: EncodeLatency,
+    pub owner: AtomicPtr<Session>,  // Session and index of the track, set when a handle to it is taken
+    pub idx: AtomicU32,
+}
+
+impl Default for Track {
+    fn default() -> Track {
+        Track {
+            counters: TrackCounters::default(),
+            sent: SentRefs::default(),
+            marks: EventRing::new(),
+            epoch: FrozenKeyframe::default(),
+            rates: TrackRates::new(),
+            latency: EncodeLatency::new(),
+            owner: AtomicPtr::new(ptr::null_mut()),
+            idx: AtomicU32::new(0),
+        }
+    }
+}
+
+pub struct TrackTable<T = Track> {
+    segments: [AtomicPtr<T>; SEGMENTS],
+    len: AtomicUsize,   // Tracks in use, all segments below are allocated
+    grow: Mutex<()>,
+}
+
+impl<T: Default> TrackTable<T> {
+    pub const fn new() -> TrackTable<T> {
+        TrackTable {
+            segments: [const { AtomicPtr::new(ptr::null_mut()) }; SEGMENTS],
+            len: AtomicUsize::new(0),
+            grow: Mutex::new(()),
+        }
+    }
+
+    /// Number of tracks in use (highest used index + 1)
+    pub fn len(&self) -> usize {
+        self.len.load(Ordering::Acquire)
+    }
+
+    /// Track by index, None if not in use
+    #[inline]
+    pub fn get(&self, idx: usize) -> Option<&T> {
+        if idx >= self.len() {
+            return None;
+        }
+        let (segment, offset) = locate(idx);
+        let base = self.segments[segment].load(Ordering::Acquire);
+        Some(unsafe { &*base.add(offset) })
+    }
+
+    /// Track by index, allocating the table up to it if needed. None if beyond MAX_TRACKS.
+    #[inline]
+    pub fn get_or_insert(&self, idx: usize) -> Option<&T> {
+        match self.get(idx) {
+            Some(track) => Some(track),
+            None => self.insert(idx),
+        }
+    }
+
+    #[cold]
+    fn insert(&self, idx: usize) -> Option<&T> {
+        if idx >= MAX_TRACKS {
+            return None;
+        }
+
+        let _guard = self.grow.lock();
+        let (last_segment, _) = locate(idx);
+        for segment in 0..=last_segment {
+            if self.segments[segment].load(Ordering::Relaxed).is_null() {
+                let tracks: Box<[T]> = (0..segment_size(segment)).map(|_| T::default()).collect();
+                self.segments[segment].store(Box::into_raw(tracks) as *mut T, Ordering::Release);
+            }
+        }
+        if idx >= self.len.load(Ordering::Relaxed) {
+            self.len.store(idx + 1, Ordering::Release);
+        }
+        self.get(idx)
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = &T> {
+        (0..self.len()).filter_map(move |idx| self.get(idx))
+    }
+}
+
+impl<T> Drop for TrackTable<T> {
+    fn drop(&mut self) {
+        for (segment, base) in self.segments.iter().enumerate() {
+            let base = base.load(Ordering::Relaxed);
+            if !base.is_null() {
+                unsafe { drop(Box::from_raw(ptr::slice_from_raw_parts_mut(base, segment_size(segment)))) };
+            }
+        }
+    }
+}
+
+fn segment_size(segment: usize) -> usize {
+    if segment == 0 { SEGMENT_BASE } else { SEGMENT_BASE << (segment - 1) }
+}
+
+/// Segment and offset in the segment of a track index
+#[inline]
+fn locate(idx: usize) -> (usize, usize) {
+    let block = idx / SEGMENT_BASE;
+    if block == 0 {
+        return (0, idx);
+    }
+    let segment = (usize::BITS - block.leading_zeros()) as usize;
+    (segment, idx - (SEGMENT_BASE << (segment - 1)))
+}
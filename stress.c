@@ -0,0 +1,298 @@
+#include "bpm.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Threading model of an encoder: one compositor thread counting lagged frames, an encoder
+// thread per rendition counting encoded frames and keyframe threads rendering the metrics,
+// all at once. Checks that the deltas sent in the rendered SM and ERM add up to the frames
+// counted, and reports throughput and render latency under contention.
+
+#define MAX_ENCODERS 16
+#define KEYFRAME_THREADS 2
+#define LAG_INTERVAL 16         // Compositor lags a frame per this many encoded ones
+#define MAX_RENDERS 200000      // Render latencies kept per keyframe thread
+
+// Offsets of the counters in the payloads
+static const uint32_t sm_offsets[4] = { 46, 51, 56, 61 };    // rendered, lagged, dropped, output
+static const uint32_t erm_offsets[3] = { 46, 51, 56 };       // input, skipped, output
+
+static int encoders = 4;
+static int local_counters = 0;
+static int frames = 1000000;
+static atomic_int encoders_done;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t counter_at(const uint8_t* data, uint32_t offset) {
+    return (uint32_t)data[offset] << 24 | (uint32_t)data[offset + 1] << 16 |
+           (uint32_t)data[offset + 2] << 8 | (uint32_t)data[offset + 3];
+}
+
+/* Counting threads */
+
+typedef struct {
+    pthread_t thread;
+    int track_idx;
+    pthread_barrier_t* start;
+    uint64_t elapsed_ns;
+} counter_t;
+
+static void* encode(void* arg) {
+    counter_t* encoder = arg;
+    pthread_barrier_wait(encoder->start);
+    uint64_t start = now_ns();
+    for (int i=0; i<frames; i++) {
+        bpm_frame_encoded(encoder->track_idx);
+    }
+    encoder->elapsed_ns = now_ns() - start;
+    atomic_fetch_add(&encoders_done, 1);
+    return NULL;
+}
+
+// Lags frames of every track in turn, as many as the encoders would have skipped
+static void* composite(void* arg) {
+    counter_t* compositor = arg;
+    pthread_barrier_wait(compositor->start);
+    uint64_t start = now_ns();
+    for (int i=0; i<frames / LAG_INTERVAL * encoders; i++) {
+        bpm_frame_lagged(i % encoders);
+    }
+    compositor->elapsed_ns = now_ns() - start;
+    return NULL;
+}
+
+/* Keyframe threads, rendering until the counting is done */
+
+typedef struct {
+    pthread_t thread;
+    pthread_barrier_t* start;
+    uint64_t sm[MAX_ENCODERS][4];   // Sums of the deltas sent, by track
+    uint64_t erm[MAX_ENCODERS][3];
+    uint64_t* render_ns;
+    int renders;
+    int failed;
+} renderer_t;
+
+static void add_sm(renderer_t* renderer, int track_idx, const uint8_t* sm) {
+    for (int i=0; i<4; i++) {
+        renderer->sm[track_idx][i] += counter_at(sm, sm_offsets[i]);
+    }
+}
+
+static void add_erm(renderer_t* renderer, int track_idx, const uint8_t* erm) {
+    for (int i=0; i<3; i++) {
+        renderer->erm[track_idx][i] += counter_at(erm, erm_offsets[i]);
+    }
+}
+
+// Keyframe bundles and separate SM and ERM renders in turn
+static int render(renderer_t* renderer, int track_idx, int separate) {
+    uint8_t data[BPM_KEYFRAME_SIZE];
+    uint32_t size = 0;
+    if (separate) {
+        if (bpm_render_sm_into(track_idx, data, BPM_SM_SIZE, &size) != 0) {
+            return -1;
+        }
+        add_sm(renderer, track_idx, data);
+        if (bpm_render_erm_into(track_idx, data, BPM_ERM_SIZE, &size) != 0) {
+            return -1;
+        }
+        add_erm(renderer, track_idx, data);
+        return 0;
+    }
+
+    bpm_keyframe_t layout;
+    if (bpm_render_keyframe(track_idx, 0, 0, 0, 0, data, sizeof(data), &size, &layout) != 0) {
+        return -1;
+    }
+    add_sm(renderer, track_idx, data + layout.sm_offset);
+    add_erm(renderer, track_idx, data + layout.erm_offset);
+    return 0;
+}
+
+static void* render_keyframes(void* arg) {
+    renderer_t* renderer = arg;
+    pthread_barrier_wait(renderer->start);
+    for (int i=0; atomic_load(&encoders_done) < encoders; i++) {
+        uint64_t start = now_ns();
+        if (render(renderer, i % encoders, (i / encoders) & 1) != 0) {
+            renderer->failed++;
+        }
+        if (renderer->renders < MAX_RENDERS) {
+            renderer->render_ns[renderer->renders++] = now_ns() - start;
+        }
+    }
+    return NULL;
+}
+
+/* Report */
+
+static int check(const char* name, int track_idx, uint64_t sent, uint64_t counted) {
+    if (sent == counted) {
+        return 0;
+    }
+    printf("FAIL track %d %s: sent %llu, counted %llu\n", track_idx, name,
+           (unsigned long long)sent, (unsigned long long)counted);
+    return 1;
+}
+
+// The deltas of every render of a track add up to the counters at its last render
+static int check_conservation(renderer_t* renderers) {
+    uint64_t encoded = (uint64_t)frames * encoders;
+    uint64_t lagged = (uint64_t)frames / LAG_INTERVAL * encoders;
+    int failures = 0;
+    for (int t=0; t<encoders; t++) {
+        uint64_t sm[4] = {0}, erm[3] = {0};
+        for (int r=0; r<KEYFRAME_THREADS + 1; r++) {
+            for (int i=0; i<4; i++) sm[i] += renderers[r].sm[t][i];
+            for (int i=0; i<3; i++) erm[i] += renderers[r].erm[t][i];
+        }
+        uint64_t track_lagged = lagged / encoders;
+        failures += check("SM rendered", t, sm[0], frames);
+        failures += check("SM lagged", t, sm[1], lagged);
+        failures += check("SM dropped", t, sm[2], 0);
+        failures += check("SM output", t, sm[3], encoded);
+        failures += check("ERM input", t, erm[0], frames + track_lagged);
+        failures += check("ERM skipped", t, erm[1], track_lagged);
+        failures += check("ERM output", t, erm[2], frames);
+    }
+    return failures;
+}
+
+static void report_renders(renderer_t* renderers) {
+    int n = 0;
+    for (int r=0; r<KEYFRAME_THREADS; r++) {
+        n += renderers[r].renders;
+    }
+    if (n == 0) {
+        printf("No renders during the counting\n");
+        return;
+    }
+    uint64_t* all = malloc(n * sizeof(uint64_t));
+    int k = 0;
+    for (int r=0; r<KEYFRAME_THREADS; r++) {
+        memcpy(all + k, renderers[r].render_ns, renderers[r].renders * sizeof(uint64_t));
+        k += renderers[r].renders;
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+    uint64_t p50 = all[(n - 1) / 2], p99 = all[(int)(0.99 * (n - 1))], max = all[n - 1];
+    // A tail far above the median is renders queued behind each other on the state lock
+    printf("Renders %d, ns p50 %llu, p99 %llu, max %llu, p99/p50 %.1f\n", n, (unsigned long long)p50,
+           (unsigned long long)p99, (unsigned long long)max, p50 > 0 ? (double)p99 / p50 : 0.0);
+    free(all);
+}
+
+static void report_lock(void) {
+    bpm_stats_t stats;
+    if (bpm_get_stats(&stats) != 0) {
+        printf("Lock wait: build the library with --features stats\n");
+        return;
+    }
+    uint64_t waits = 0, p99 = 0, seen = 0;
+    for (int i=0; i<BPM_STATS_BUCKETS; i++) {
+        waits += stats.lock_wait_ns[i];
+    }
+    for (int i=0; i<BPM_STATS_BUCKETS && waits > 0; i++) {
+        seen += stats.lock_wait_ns[i];
+        if (seen * 100 >= waits * 99) {
+            p99 = 1ull << i;
+            break;
+        }
+    }
+    // Convoys wait on the state lock about as long as it is held, or longer
+    printf("Lock wait %llu locks, mean %.0f ns, p99 < %llu ns, wait/hold %.2f\n",
+           (unsigned long long)waits, waits > 0 ? (double)stats.lock_wait_ns_sum / waits : 0.0,
+           (unsigned long long)p99,
+           stats.lock_hold_ns_sum > 0 ? (double)stats.lock_wait_ns_sum / stats.lock_hold_ns_sum : 0.0);
+}
+
+int main(int argc, char** argv) {
+    int positional = 0;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--local") == 0) {
+            local_counters = 1;
+            bpm_set_local_counters(1);
+        } else if (positional++ == 0) {
+            encoders = atoi(argv[i]);
+        } else {
+            frames = atoi(argv[i]);
+        }
+    }
+    if (encoders < 1 || encoders > MAX_ENCODERS || frames < 1) {
+        fprintf(stderr, "Usage: %s [--local] [encoders 1-%d] [frames per encoder]\n", argv[0], MAX_ENCODERS);
+        return 2;
+    }
+
+    for (int i=0; i<encoders; i++) {
+        char fingerprint[16];
+        snprintf(fingerprint, sizeof(fingerprint), "track%d", i);
+        bpm_get_track_index(fingerprint);
+    }
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, encoders + KEYFRAME_THREADS + 2);
+    counter_t counters[MAX_ENCODERS + 1];
+    static renderer_t renderers[KEYFRAME_THREADS + 1];
+    for (int i=0; i<=encoders; i++) {
+        counters[i].track_idx = i;
+        counters[i].start = &start;
+        pthread_create(&counters[i].thread, NULL, i < encoders ? encode : composite, &counters[i]);
+    }
+    for (int r=0; r<KEYFRAME_THREADS; r++) {
+        renderers[r].start = &start;
+        renderers[r].render_ns = malloc(MAX_RENDERS * sizeof(uint64_t));
+        pthread_create(&renderers[r].thread, NULL, render_keyframes, &renderers[r]);
+    }
+    pthread_barrier_wait(&start);
+    uint64_t begin = now_ns();
+    for (int i=0; i<=encoders; i++) {
+        pthread_join(counters[i].thread, NULL);
+    }
+    uint64_t elapsed = now_ns() - begin;
+    for (int r=0; r<KEYFRAME_THREADS; r++) {
+        pthread_join(renderers[r].thread, NULL);
+    }
+    pthread_barrier_destroy(&start);
+
+    // Last keyframe of every track, sending what is left
+    renderer_t* last = &renderers[KEYFRAME_THREADS];
+    for (int t=0; t<encoders; t++) {
+        last->failed += render(last, t, 0) != 0;
+    }
+
+    uint64_t calls = (uint64_t)frames * encoders + (uint64_t)frames / LAG_INTERVAL * encoders;
+    printf("%d encoders, %d frames each, %d keyframe threads%s\n", encoders, frames, KEYFRAME_THREADS,
+           local_counters ? ", thread-local counters" : "");
+    printf("Frame calls %.1f M/s\n", (double)calls * 1e3 / elapsed);
+    for (int i=0; i<=encoders; i++) {
+        printf("  %s %2d %10.1f Mframes/s\n", i < encoders ? "encoder   " : "compositor", i,
+               (double)(i < encoders ? frames : frames / LAG_INTERVAL * encoders) * 1e3 / counters[i].elapsed_ns);
+    }
+    report_renders(renderers);
+    report_lock();
+
+    int failures = check_conservation(renderers);
+    for (int r=0; r<=KEYFRAME_THREADS; r++) {
+        failures += renderers[r].failed;
+        free(renderers[r].render_ns);
+    }
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("Counters conserved\n");
+    return 0;
+}